@@ -0,0 +1,375 @@
+/* credis_bench.c -- micro benchmark of credis request building and reply
+ * parsing
+ *
+ * Feeds canned replies to a credis handle through a socketpair, so no redis
+ * server is needed: integer, small and large bulk, large multi-bulk and
+ * pipelined integer replies. For each it reports the time and the number of
+ * credis allocations per command. A command includes sending its request,
+ * and writing its reply into the socket and draining its request, which
+ * cost the same for any parser.
+ *
+ * Request building is also timed on its own, without any I/O: a DECRBY and
+ * a 1000 key MGET encoded into a buffer the way credis sends them.
+ *
+ * credis.c is included rather than linked, to set up a handle on the
+ * socketpair and to count its malloc(), calloc() and realloc() calls. Build
+ * against another copy of credis.c to compare parsers, see the Makefile:
+ *
+ *   make -C bench run
+ *   git show <older commit>:credis.c > /tmp/credis-old.c
+ *   make -C bench run CREDIS_SOURCE=/tmp/credis-old.c
+ *
+ * Usage: credis_bench [iterations scale, default 1]
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sys/epoll.h>
+#endif
+
+static long bench_allocs;
+
+static void *bench_malloc(size_t size)
+{
+  bench_allocs++;
+  return malloc(size);
+}
+
+static void *bench_calloc(size_t nmemb, size_t size)
+{
+  bench_allocs++;
+  return calloc(nmemb, size);
+}
+
+static void *bench_realloc(void *ptr, size_t size)
+{
+  bench_allocs++;
+  return realloc(ptr, size);
+}
+
+#define malloc(size) bench_malloc(size)
+#define calloc(nmemb, size) bench_calloc(nmemb, size)
+#define realloc(ptr, size) bench_realloc(ptr, size)
+
+#ifndef CREDIS_SOURCE
+#define CREDIS_SOURCE "../credis.c"
+#endif
+#include CREDIS_SOURCE
+
+#undef malloc
+#undef calloc
+#undef realloc
+
+#define BENCH_TIMEOUT 2000      /* ms */
+#define BENCH_SMALL_BULK 64
+#define BENCH_LARGE_BULK 65536
+#define BENCH_MULTIBULK 1000    /* elements of BENCH_SMALL_BULK bytes */
+#define BENCH_PIPELINE 100      /* commands per pipeline */
+
+typedef struct {
+  REDIS rhnd;
+  int peer;                     /* the "server" end of the socketpair */
+  char *reply;                  /* canned reply to one command */
+  int reply_len;
+  char *drain;                  /* requests are read into this and dropped */
+  int drain_size;
+  int fresh;                    /* each command on a new handle */
+  long long fresh_ns;           /* time and allocations spent on new handles */
+  long fresh_allocs;
+} bench_ctx;
+
+static const char *keyv[BENCH_MULTIBULK];
+
+static void die(const char *what, int rc)
+{
+  fprintf(stderr, "credis_bench: %s failed: %d (%s)\n", what, rc, strerror(errno));
+  exit(1);
+}
+
+static long long bench_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Appends `len' bytes of `data' to the canned reply */
+static void reply_add(bench_ctx *ctx, const char *data, int len)
+{
+  if ((ctx->reply = realloc(ctx->reply, ctx->reply_len + len)) == NULL)
+    die("realloc", 0);
+  memcpy(ctx->reply + ctx->reply_len, data, len);
+  ctx->reply_len += len;
+}
+
+static void reply_bulk(bench_ctx *ctx, int size)
+{
+  char hdr[32];
+  char *data;
+
+  if ((data = malloc(size)) == NULL)
+    die("malloc", 0);
+  memset(data, 'x', size);
+  reply_add(ctx, hdr, snprintf(hdr, sizeof(hdr), "$%d\r\n", size));
+  reply_add(ctx, data, size);
+  reply_add(ctx, "\r\n", 2);
+  free(data);
+}
+
+/* Writes the canned reply, `times' over, for the client to read */
+static void feed(bench_ctx *ctx, int times)
+{
+  int i, rc, sent;
+
+  for (i = 0; i < times; i++)
+    for (sent = 0; sent < ctx->reply_len; sent += rc)
+      if ((rc = write(ctx->peer, ctx->reply + sent, ctx->reply_len - sent)) < 0)
+        die("write", rc);
+}
+
+/* Gives `ctx' a new handle on a new socketpair */
+static void bench_open(bench_ctx *ctx)
+{
+  int sv[2];
+
+  if (ctx->rhnd != NULL) {
+    credis_close(ctx->rhnd);
+    close(ctx->peer);
+  }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+    die("socketpair", -1);
+  if ((ctx->rhnd = cr_new()) == NULL)
+    die("cr_new", -1);
+  ctx->rhnd->fd = sv[0];
+  ctx->rhnd->timeout = BENCH_TIMEOUT;
+  ctx->peer = sv[1];
+}
+
+/* Gives a command a new handle if `ctx->fresh', not counting the time and
+ * allocations this takes */
+static void bench_fresh(bench_ctx *ctx)
+{
+  long long start;
+  long allocs;
+
+  if (!ctx->fresh)
+    return;
+
+  start = bench_ns();
+  allocs = bench_allocs;
+  bench_open(ctx);
+  ctx->fresh_ns += bench_ns() - start;
+  ctx->fresh_allocs += bench_allocs - allocs;
+}
+
+/* Drops the requests the client has sent so far */
+static void drain(bench_ctx *ctx)
+{
+  while (recv(ctx->peer, ctx->drain, ctx->drain_size, MSG_DONTWAIT) > 0)
+    ;
+}
+
+static void report(bench_ctx *ctx, const char *name, int ops, long long ns, long allocs)
+{
+  ns -= ctx->fresh_ns;
+  allocs -= ctx->fresh_allocs;
+  ctx->fresh_ns = 0;
+  ctx->fresh_allocs = 0;
+  printf("%-28s %8d ops %10.1f ns/op %8.2f allocs/op\n",
+         name, ops, (double)ns / ops, (double)allocs / ops);
+}
+
+static void bench_int(bench_ctx *ctx, int ops)
+{
+  long long start;
+  long allocs;
+  int i, rc, val;
+
+  ctx->reply_len = 0;
+  reply_add(ctx, ":1234567\r\n", 10);
+
+  allocs = bench_allocs;
+  start = bench_ns();
+  for (i = 0; i < ops; i++) {
+    bench_fresh(ctx);
+    feed(ctx, 1);
+    if ((rc = credis_incr(ctx->rhnd, "rn_bench", &val)) != 0 || val != 1234567)
+      die("INCR", rc);
+    drain(ctx);
+  }
+  report(ctx, "integer", ops, bench_ns() - start, bench_allocs - allocs);
+}
+
+static void bench_bulk(bench_ctx *ctx, const char *name, int size, int ops)
+{
+  long long start;
+  long allocs;
+  int i, rc;
+  char *val;
+
+  ctx->reply_len = 0;
+  reply_bulk(ctx, size);
+
+  allocs = bench_allocs;
+  start = bench_ns();
+  for (i = 0; i < ops; i++) {
+    bench_fresh(ctx);
+    feed(ctx, 1);
+    if ((rc = credis_get(ctx->rhnd, "rn_bench", &val)) != 0 ||
+        (int)strlen(val) != size)
+      die("GET", rc);
+    drain(ctx);
+  }
+  report(ctx, name, ops, bench_ns() - start, bench_allocs - allocs);
+}
+
+static void bench_multibulk(bench_ctx *ctx, const char *name, int ops)
+{
+  long long start;
+  long allocs;
+  int i, rc;
+  char hdr[32];
+  char **valv = NULL;
+
+  ctx->reply_len = 0;
+  reply_add(ctx, hdr, snprintf(hdr, sizeof(hdr), "*%d\r\n", BENCH_MULTIBULK));
+  for (i = 0; i < BENCH_MULTIBULK; i++)
+    reply_bulk(ctx, BENCH_SMALL_BULK);
+
+  allocs = bench_allocs;
+  start = bench_ns();
+  for (i = 0; i < ops; i++) {
+    bench_fresh(ctx);
+    feed(ctx, 1);
+    if ((rc = credis_mget(ctx->rhnd, BENCH_MULTIBULK, keyv, &valv)) != BENCH_MULTIBULK ||
+        strlen(valv[BENCH_MULTIBULK - 1]) != BENCH_SMALL_BULK)
+      die("MGET", rc);
+    drain(ctx);
+  }
+  report(ctx, name, ops, bench_ns() - start, bench_allocs - allocs);
+}
+
+/* Encodes `argc' arguments in `argv' followed by `keyc' keys in `keyv' into
+ * `buf', as cr_sendargvandreceive() does, without sending them. `buf' is
+ * reused, it only grows on the first request */
+static void bench_encode(bench_ctx *ctx, const char *name, int argc, const char **argv,
+                         int keyc, const char **keyv, int ops)
+{
+  cr_buffer buf;
+  long long start;
+  long allocs;
+  int i, rc;
+
+  memset(&buf, 0, sizeof(buf));
+
+  allocs = bench_allocs;
+  start = bench_ns();
+  for (i = 0; i < ops; i++) {
+    buf.len = 0;
+    if ((rc = cr_appendcount(&buf, argc + keyc)) != 0 ||
+        (rc = cr_appendargv(&buf, argc, argv, NULL)) != 0 ||
+        (rc = cr_appendargv(&buf, keyc, keyv, NULL)) != 0)
+      die("encode", rc);
+  }
+  report(ctx, name, ops, bench_ns() - start, bench_allocs - allocs);
+
+  /* Keeps the compiler from dropping the loop */
+  if (buf.len == 0 || buf.data[0] != '*')
+    die("encode", buf.len);
+  free(buf.data);
+}
+
+/* ns/op and allocs/op are per pipelined command */
+static void bench_pipeline(bench_ctx *ctx, int ops)
+{
+  const char *argv[2] = {"INCR", "rn_bench"};
+  long long start;
+  long allocs;
+  int i, j, rc, val;
+
+  ctx->reply_len = 0;
+  reply_add(ctx, ":1234567\r\n", 10);
+
+  allocs = bench_allocs;
+  start = bench_ns();
+  for (i = 0; i < ops; i++) {
+    credis_pipeline_begin(ctx->rhnd);
+    for (j = 0; j < BENCH_PIPELINE; j++)
+      if ((rc = credis_pipeline_append(ctx->rhnd, 2, argv, NULL)) != 0)
+        die("pipeline append", rc);
+    if ((rc = credis_pipeline_flush(ctx->rhnd)) != BENCH_PIPELINE)
+      die("pipeline flush", rc);
+    feed(ctx, BENCH_PIPELINE);
+    for (j = 0; j < BENCH_PIPELINE; j++)
+      if ((rc = credis_pipeline_read_int(ctx->rhnd, &val)) != 0 || val != 1234567)
+        die("pipeline read", rc);
+    drain(ctx);
+  }
+  report(ctx, "pipelined integer x 100", ops * BENCH_PIPELINE,
+         bench_ns() - start, bench_allocs - allocs);
+}
+
+int main(int argc, char **argv)
+{
+  bench_ctx ctx;
+  const char *decrby[3] = {"DECRBY", "rn_bench", "1500000"};
+  const char *mget[1] = {"MGET"};
+  int i, scale = 1;
+  char key[32];
+
+  if (argc > 1 && (scale = atoi(argv[1])) <= 0) {
+    fprintf(stderr, "usage: %s [iterations scale]\n", argv[0]);
+    return 1;
+  }
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.drain_size = 256 * 1024;
+  if ((ctx.drain = malloc(ctx.drain_size)) == NULL)
+    die("malloc", 0);
+
+  for (i = 0; i < BENCH_MULTIBULK; i++) {
+    snprintf(key, sizeof(key), "rn_bench_%d", i);
+    keyv[i] = strdup(key);
+  }
+
+  /* the first large reply on a handle grows its buffers */
+  ctx.fresh = 1;
+  bench_bulk(&ctx, "bulk 64KB, new handle", BENCH_LARGE_BULK, 2000 * scale);
+  bench_multibulk(&ctx, "multi-bulk, new handle", 2000 * scale);
+  printf("\n");
+
+  /* the rest reuse one handle, its buffers have grown already */
+  ctx.fresh = 0;
+  bench_int(&ctx, 200000 * scale);
+  bench_bulk(&ctx, "bulk 64B", BENCH_SMALL_BULK, 200000 * scale);
+  bench_bulk(&ctx, "bulk 64KB", BENCH_LARGE_BULK, 5000 * scale);
+  bench_multibulk(&ctx, "multi-bulk 1000 x 64B", 2000 * scale);
+  bench_pipeline(&ctx, 5000 * scale);
+  printf("\n");
+
+  /* request building alone, no I/O */
+  bench_encode(&ctx, "encode DECRBY", 3, decrby, 0, NULL, 2000000 * scale);
+  bench_encode(&ctx, "encode MGET 1000 keys", 1, mget, BENCH_MULTIBULK, keyv, 20000 * scale);
+
+  credis_close(ctx.rhnd);
+  close(ctx.peer);
+
+  return 0;
+}
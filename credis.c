@@ -33,7 +33,8 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -45,6 +46,11 @@
 
 #include "credis.h"
 
+#ifdef CREDIS_ASYNC
+#include <pthread.h>
+#include <sys/epoll.h>
+#endif
+
 #define CR_ERROR '-'
 #define CR_INLINE '+'
 #define CR_BULK '$'
@@ -54,6 +60,7 @@
 #define CR_BUFFER_SIZE 4096
 #define CR_BUFFER_WATERMARK ((CR_BUFFER_SIZE)/10+1)
 #define CR_MULTIBULK_SIZE 256
+#define CR_INT_STRING_SIZE 24
 
 #define _STRINGIF(arg) #arg
 #define STRINGIFY(arg) _STRINGIF(arg)
@@ -72,6 +79,17 @@
 #define DEBUG(...)
 #endif
 
+#ifdef CREDIS_USDT
+/* add -DCREDIS_USDT to CPPFLAGS for USDT probes (provider "credis") that 
+ * SystemTap, perf and bpftrace can attach to, needs <sys/sdt.h> */
+#include <sys/sdt.h>
+#define PROBE2(name, a, b) DTRACE_PROBE2(credis, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(credis, name, a, b, c)
+#else
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#endif
+
 typedef struct _cr_buffer {
   char *data;
   int idx;
@@ -87,7 +105,7 @@ typedef struct _cr_multibulk {
 } cr_multibulk;
 
 typedef struct _cr_reply {
-  int integer;
+  long long integer;
   char *line;
   char *bulk;
   cr_multibulk multibulk;
@@ -101,34 +119,41 @@ typedef struct _cr_redis {
   cr_buffer buf;
   cr_reply reply;
   int error;
+  int pipelined; /* number of pipelined replies not yet read */
+  long long deadline; /* when the command in progress times out, see cr_now() */
 } cr_redis;
 
 
-/* Returns pointer to the '\r' of the first occurence of "\r\n", or NULL
- * if not found */
+/* Returns pointer to the '\r' of the first occurence of "\r\n" within
+ * the `len' bytes at `buf', or NULL if not found. Lines are short, and 
+ * the data of a bulk isn't searched (see cr_readln()), so a byte loop 
+ * beats memchr() here */
 static char * cr_findnl(char *buf, int len) {
-  while (--len >= 0) {
-    if (*(buf++) == '\r')
-      if (*buf == '\n')
-        return --buf;
-  }
+  char *end = buf + len - 1;
+
+  for (; buf < end; buf++)
+    if (*buf == '\r' && buf[1] == '\n')
+      return buf;
   return NULL;
 }
 
 /* Allocate at least `size' bytes more buffer memory, keeping content of
- * previously allocated memory untouched.
+ * previously allocated memory untouched. The buffer at least doubles, so
+ * a large reply costs a few reallocations rather than one per 
+ * CR_BUFFER_SIZE bytes.
  * Returns:
  *   0  on success
  *  -1  on error, i.e. more memory not available */
 static int cr_moremem(cr_buffer *buf, int size)
 {
   char *ptr;
-  int total, n;
+  int total;
 
-  n = size / CR_BUFFER_SIZE + 1;
-  total = buf->size + n * CR_BUFFER_SIZE;
+  total = buf->size + (size / CR_BUFFER_SIZE + 1) * CR_BUFFER_SIZE;
+  if (total < buf->size * 2)
+    total = buf->size * 2;
 
-  DEBUG("allocate %d x CR_BUFFER_SIZE, total %d bytes", n, total);
+  DEBUG("allocate %d bytes more, total %d bytes", total - buf->size, total);
 
   ptr = realloc(buf->data, total);
   if (ptr == NULL)
@@ -167,113 +192,313 @@ static int cr_morebulk(cr_multibulk *mb, int size)
   return 0;
 }
 
-/* Appends a string `str' to the end of buffer `buf'. If available memory
- * in buffer is not enough to hold `str' more memory is allocated to the
- * buffer. If `space' is not 0 `str' is padded with a space.
+/* Formats `val' as a decimal string at the end of `buf', which must hold
+ * at least CR_INT_STRING_SIZE bytes. Returns pointer to the zero-terminated 
+ * string within `buf'. */
+static char *cr_itoa(long long val, char *buf)
+{
+  char *p = buf + CR_INT_STRING_SIZE - 1;
+  unsigned long long u = val < 0 ? -(unsigned long long)val : (unsigned long long)val;
+
+  *p = '\0';
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+
+  if (val < 0)
+    *--p = '-';
+
+  return p;
+}
+
+/* Makes sure there is room for at least `len' more bytes in buffer `buf'.
  * Returns:
  *   0  on success
  *  <0  on error, i.e. more memory not available */
-static int cr_appendstr(cr_buffer *buf, const char *str, int space)
+static int cr_reserve(cr_buffer *buf, int len)
+{
+  int avail = buf->size - buf->len;
+
+  if (avail < len && cr_moremem(buf, len - avail))
+    return CREDIS_ERR_NOMEM;
+
+  return 0;
+}
+
+/* Appends "<prefix><n>\r\n" to the end of buffer `buf', which must have 
+ * room for it, see cr_reserve(). */
+static void cr_appendhdr(cr_buffer *buf, char prefix, int n)
 {
-  int rc, avail;
-  char *format = (space==0?"%s":" %s");
+  char tmp[CR_INT_STRING_SIZE + 1];
+  char *p = cr_itoa(n, tmp);
+  int len;
 
-  /* TODO instead of using formatted print use memcpy() and don't
-     blindly add a space before `str' */
+  *--p = prefix;
+  tmp[CR_INT_STRING_SIZE - 1] = '\r';
+  tmp[CR_INT_STRING_SIZE] = '\n';
+  len = tmp + CR_INT_STRING_SIZE + 1 - p;
 
-  avail = buf->size - buf->len;
-  rc = snprintf(buf->data + buf->len, avail, format, str);
-  if (rc >= avail) {
-    DEBUG("truncated, get more memory and try again");
-    if (cr_moremem(buf, rc - avail + 1))
-      return CREDIS_ERR_NOMEM;
-    
-    avail = buf->size - buf->len;
-    rc = snprintf(buf->data + buf->len, avail, format, str);
-  }
-  buf->len += rc;
+  memcpy(buf->data + buf->len, p, len);
+  buf->len += len;
+}
+
+/* Appends one argument of a multi-bulk request, i.e. "$<len>\r\n<arg>\r\n",
+ * to the end of buffer `buf'. `arg' may contain any bytes.
+ * Returns:
+ *   0  on success
+ *  <0  on error, i.e. more memory not available */
+static int cr_appendarg(cr_buffer *buf, const char *arg, int len)
+{
+  if (cr_reserve(buf, len + CR_INT_STRING_SIZE + 4))
+    return CREDIS_ERR_NOMEM;
+
+  cr_appendhdr(buf, CR_BULK, len);
+  memcpy(buf->data + buf->len, arg, len);
+  buf->len += len;
+  buf->data[buf->len++] = '\r';
+  buf->data[buf->len++] = '\n';
 
   return 0;
 }
 
-/* Appends an array of strings `strv' to the end of buffer `buf', each 
- * separated with a space. If `newline' is not 0 "\r\n" is added last 
- * to buffer.
+/* Appends `argc' arguments in `argv' to the end of buffer `buf', see 
+ * cr_appendarg(). Length of each argument is taken from `argvlen', or 
+ * strlen() if `argvlen' is NULL.
  * Returns:
  *   0  on success
  *  <0  on error, i.e. more memory not available */
-int cr_appendstrarray(cr_buffer *buf, int strc, const char **strv, int newline)
+static int cr_appendargv(cr_buffer *buf, int argc, const char **argv, const int *argvlen)
 {
   int rc, i;
 
-  for (i = 0; i < strc; i++) {
-    if ((rc = cr_appendstr(buf, strv[i], 1)) != 0)
+  for (i = 0; i < argc; i++)
+    if ((rc = cr_appendarg(buf, argv[i], argvlen ? argvlen[i] : (int)strlen(argv[i]))) != 0)
       return rc;
+
+  return 0;
+}
+
+/* Appends the "*<n>\r\n" header of a multi-bulk request of `n' arguments
+ * to the end of buffer `buf'.
+ * Returns:
+ *   0  on success
+ *  <0  on error, i.e. more memory not available */
+static int cr_appendcount(cr_buffer *buf, int n)
+{
+  if (cr_reserve(buf, CR_INT_STRING_SIZE + 2))
+    return CREDIS_ERR_NOMEM;
+
+  cr_appendhdr(buf, CR_MULTIBULK, n);
+
+  return 0;
+}
+
+/* Returns milliseconds from a monotonic clock, which unlike the time of
+ * day doesn't jump when the system clock is set. */
+static long long cr_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Waits for socket `fd' to become ready for `events' (POLLIN/POLLOUT) 
+ * until `deadline', see cr_now(). Unlike select() this works for any fd 
+ * number, also those above FD_SETSIZE.
+ * Returns:
+ *  >0  on ready, or when an error is pending on the socket
+ *   0  on timeout
+ *  -1  on error */
+static int cr_poll(int fd, short events, long long deadline)
+{
+  struct pollfd pfd;
+  long long msecs;
+  int rc;
+
+  pfd.fd = fd;
+  pfd.events = events;
+
+  do {
+    pfd.revents = 0;
+    if ((msecs = deadline - cr_now()) < 0)
+      msecs = 0;
+    rc = poll(&pfd, 1, (int)msecs);
+  } while (rc < 0 && errno == EINTR);
+
+  return rc;
+}
+
+#ifdef CREDIS_FAULTS
+typedef struct _cr_faultconf {
+  REDIS_FAULTS faults;
+  unsigned int threads;         /* threads that have seeded from it so far */
+} cr_faultconf;
+
+/* Swapped in whole, so readers never see half of a new config. A config
+ * is never freed, a thread may still be reading it, and there are only 
+ * as many as times the faults were set */
+static cr_faultconf *cr_faultcur;
+
+/* Each thread draws its own random numbers, see cr_faultget() */
+static __thread cr_faultconf *cr_faultseen;
+static __thread unsigned int cr_faultseed;
+
+void credis_set_faults(const REDIS_FAULTS *faults)
+{
+  cr_faultconf *conf = NULL;
+
+  if (faults != NULL && (conf = calloc(1, sizeof(*conf))) != NULL) {
+    conf->faults = *faults;
+    if (conf->faults.seed == 0)
+      conf->faults.seed = (unsigned int)cr_now();
   }
 
-  if (newline) {
-    if ((rc = cr_appendstr(buf, "\r\n", 0)) != 0)
-      return rc;
+  __atomic_store_n(&cr_faultcur, conf, __ATOMIC_RELEASE);
+}
+
+/* Returns the faults to inject, or NULL for none. A thread seeds its 
+ * random numbers from each new config, by the config's seed and the 
+ * order in which threads first get to it. So a run with a fixed seed 
+ * repeats as long as its threads come in the same order */
+static const REDIS_FAULTS *cr_faultget(void)
+{
+  cr_faultconf *conf = __atomic_load_n(&cr_faultcur, __ATOMIC_ACQUIRE);
+
+  if (conf == NULL)
+    return NULL;
+
+  if (conf != cr_faultseen) {
+    cr_faultseen = conf;
+    cr_faultseed = conf->faults.seed + 
+      0x9e3779b9u * __atomic_fetch_add(&conf->threads, 1, __ATOMIC_RELAXED);
+  }
+
+  return &conf->faults;
+}
+
+static int cr_faultrand(int n)
+{
+  cr_faultseed = cr_faultseed * 1103515245 + 12345;
+  return n > 0 ? (int)((cr_faultseed >> 16) % n) : 0;
+}
+
+static int cr_faulthit(int permille)
+{
+  return permille > 0 && cr_faultrand(1000) < permille;
+}
+
+/* Holds up the reply as configured, but not beyond `deadline' (0 for no 
+ * deadline).
+ * Returns:
+ *   0  on success
+ *  -2  if the deadline passed */
+static int cr_faultdelay(long long deadline)
+{
+  const REDIS_FAULTS *faults = cr_faultget();
+  long long msecs;
+
+  if (faults == NULL)
+    return 0;
+
+  msecs = faults->latency_ms + cr_faultrand(faults->jitter_ms + 1);
+  if (cr_faulthit(faults->stall_permille))
+    msecs += faults->stall_ms;
+
+  if (deadline > 0 && msecs > deadline - cr_now()) {
+    if ((msecs = deadline - cr_now()) > 0)
+      poll(NULL, 0, (int)msecs);
+    return -2;
   }
 
+  if (msecs > 0)
+    poll(NULL, 0, (int)msecs);
+
   return 0;
 }
 
-/* Receives at most `size' bytes from socket `fd' to `buf'. Times out after 
- * `msecs' milliseconds if no data has yet arrived.
+/* recv() that drops the connection or reads less than it could, as 
+ * configured */
+static int cr_recv(int fd, char *buf, int size)
+{
+  const REDIS_FAULTS *faults = cr_faultget();
+
+  if (faults != NULL && cr_faulthit(faults->drop_permille)) {
+    shutdown(fd, SHUT_RDWR);
+    return 0;
+  }
+
+  if (faults != NULL && size > 1 && cr_faulthit(faults->partial_permille))
+    size = 1 + cr_faultrand(size - 1);
+
+  return recv(fd, buf, size, 0);
+}
+
+/* Whether to answer the command with an error reply, as configured */
+static int cr_faulterror(void)
+{
+  const REDIS_FAULTS *faults = cr_faultget();
+
+  return faults != NULL && cr_faulthit(faults->error_permille);
+}
+#else
+#define cr_recv(fd, buf, size) recv(fd, buf, size, 0)
+#endif
+
+/* Receives at most `size' bytes from socket `fd' to `buf'. Times out at
+ * `deadline' (see cr_now()) if no data has yet arrived.
  * Returns:
  *  >0  number of read bytes on success
  *   0  server closed connection
  *  -1  on error
  *  -2  on timeout */
-static int cr_receivedata(int fd, unsigned int msecs, char *buf, int size)
+static int cr_receivedata(int fd, long long deadline, char *buf, int size)
 {
-  fd_set fds;
-  struct timeval tv;
   int rc;
 
-  tv.tv_sec = msecs/1000;
-  tv.tv_usec = (msecs%1000)*1000;
-
-  FD_ZERO(&fds);
-  FD_SET(fd, &fds);
-
-  rc = select(fd+1, &fds, NULL, NULL, &tv);
+#ifdef CREDIS_FAULTS
+  if (cr_faultdelay(deadline) != 0)
+    return -2;
+#endif
 
-  if (rc > 0)
-    return recv(fd, buf, size, 0);
+  if ((rc = cr_poll(fd, POLLIN, deadline)) > 0)
+    return cr_recv(fd, buf, size);
   else if (rc == 0)
     return -2;
   else
     return -1;  
 }
 
-/* Sends `size' bytes from `buf' to socket `fd' and times out after `msecs' 
- * milliseconds if not all data has been sent. 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT 0
+#endif
+
+/* Sends `size' bytes from `buf' to socket `fd' and times out at `deadline'
+ * (see cr_now()) if not all data has been sent. The deadline covers all
+ * partial sends.
  * Returns:
  *  >0  number of bytes sent; if less than `size' it means that timeout occurred
  *  -1  on error */
-static int cr_senddata(int fd, unsigned int msecs, char *buf, int size)
+static int cr_senddata(int fd, long long deadline, char *buf, int size)
 {
-  fd_set fds;
-  struct timeval tv;
   int rc, sent=0;
-  
-  /* NOTE: On Linux, select() modifies timeout to reflect the amount 
-   * of time not slept, on other systems it is likely not the same */
-  tv.tv_sec = msecs/1000;
-  tv.tv_usec = (msecs%1000)*1000;
 
   while (sent < size) {
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
-
-    rc = select(fd+1, NULL, &fds, NULL, &tv);
+    rc = cr_poll(fd, POLLOUT, deadline);
 
     if (rc > 0) {
-      rc = send(fd, buf+sent, size-sent, 0);
-      if (rc < 0)
+      /* poll() only promises room for some of it, a blocking send of the
+       * rest could outlast the deadline */
+      rc = send(fd, buf+sent, size-sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (rc < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+          continue;
         return -1;
+      }
       sent += rc;
     }
     else if (rc == 0) /* timeout */
@@ -289,23 +514,31 @@ static int cr_senddata(int fd, unsigned int msecs, char *buf, int size)
  * and length of that string. `start' specifies from which byte
  * to start looking for "\r\n".
  * Returns:
- *  >0  length of string to which pointer `line' refers. `idx' is
+ *  >=0 length of string to which pointer `line' refers. `idx' is
  *      an optional pointer for returning start index of line with
  *      respect to buffer.
- *   0  connection to Redis server was closed
- *  -1  on error, i.e. a string is not available */
+ *  -1  on error or if the connection to Redis server was closed
+ *  -2  on timeout
+ *  CREDIS_ERR_NOMEM if the buffer couldn't grow */
 static int cr_readln(REDIS rhnd, int start, char **line, int *idx)
 {
   cr_buffer *buf = &(rhnd->buf);
   char *nl;
-  int rc, len, avail, more;
+  int rc, len, avail, more, from;
 
   /* do we need more data before we expect to find "\r\n"? */
   if ((more = buf->idx + start + 2 - buf->len) < 0)
     more = 0;
+
+  /* where to look for "\r\n", data already searched isn't searched again */
+  from = buf->idx + start;
   
   while (more > 0 || 
-         (nl = cr_findnl(buf->data + buf->idx + start, buf->len - (buf->idx + start))) == NULL) {
+         (nl = cr_findnl(buf->data + from, buf->len - from)) == NULL) {
+    /* a '\r' at the very end may still be followed by '\n' */
+    if (more == 0 && buf->len - 1 > from)
+      from = buf->len - 1;
+
     avail = buf->size - buf->len;
     if (avail < CR_BUFFER_WATERMARK || avail < more) {
       DEBUG("available buffer memory is low, get more memory");
@@ -315,15 +548,15 @@ static int cr_readln(REDIS rhnd, int start, char **line, int *idx)
       avail = buf->size - buf->len;
     }
 
-    rc = cr_receivedata(rhnd->fd, rhnd->timeout, buf->data + buf->len, avail);
+    rc = cr_receivedata(rhnd->fd, rhnd->deadline, buf->data + buf->len, avail);
     if (rc > 0) {
       DEBUG("received %d bytes: %s", rc, buf->data + buf->len);
       buf->len += rc;
     }
     else if (rc == 0)
-      return 0; /* EOF reached, connection terminated */
+      return -1; /* EOF reached, connection terminated */
     else 
-      return -1; /* error */
+      return rc; /* error or timeout */
 
     /* do we need more data before we expect to find "\r\n"? */
     if ((more = buf->idx + start + 2 - buf->len) < 0)
@@ -344,6 +577,18 @@ static int cr_readln(REDIS rhnd, int start, char **line, int *idx)
   return len;
 }
 
+/* Error code for a reply that couldn't be read in full, `rc' being what
+ * cr_readln() returned. Part of the reply may still be unread, so the 
+ * connection is out of step with the server */
+static int cr_readerror(int rc)
+{
+  if (rc == CREDIS_ERR_NOMEM)
+    return rc;
+  if (rc == -2)
+    return CREDIS_ERR_TIMEOUT;
+  return CREDIS_ERR_RECV;
+}
+
 static int cr_receivemultibulk(REDIS rhnd, char *line) 
 {
   int bnum, blen, i, rc=0, idx;
@@ -368,7 +613,9 @@ static int cr_receivemultibulk(REDIS rhnd, char *line)
     if (blen == -1)
       rhnd->reply.multibulk.idxs[i] = -1;
     else {
-      if ((rc = cr_readln(rhnd, blen, &line, &idx)) != blen)
+      if ((rc = cr_readln(rhnd, blen, &line, &idx)) < 0)
+        return cr_readerror(rc);
+      if (rc != blen)
         return CREDIS_ERR_PROTOCOL;
 
       rhnd->reply.multibulk.idxs[i] = idx;
@@ -377,7 +624,7 @@ static int cr_receivemultibulk(REDIS rhnd, char *line)
   
   if (bnum != 0) {
     DEBUG("bnum != 0, bnum=%d, rc=%d", bnum, rc);
-    return CREDIS_ERR_PROTOCOL;
+    return rc < 0 ? cr_readerror(rc) : CREDIS_ERR_PROTOCOL;
   }
 
   rhnd->reply.multibulk.len = i;
@@ -393,19 +640,20 @@ static int cr_receivemultibulk(REDIS rhnd, char *line)
 
 static int cr_receivebulk(REDIS rhnd, char *line) 
 {
-  int blen;
+  int blen, rc;
 
   blen = atoi(line);
   if (blen == -1) {
     rhnd->reply.bulk = NULL; /* key didn't exist */
     return 0;
   }
-  if (cr_readln(rhnd, blen, &line, NULL) >= 0) {
-    rhnd->reply.bulk = line;
-    return 0;
-  }
+  if ((rc = cr_readln(rhnd, blen, &line, NULL)) < 0)
+    return cr_readerror(rc);
+  if (rc != blen)
+    return CREDIS_ERR_PROTOCOL;
 
-  return CREDIS_ERR_PROTOCOL;
+  rhnd->reply.bulk = line;
+  return 0;
 }
 
 static int cr_receiveinline(REDIS rhnd, char *line) 
@@ -416,7 +664,7 @@ static int cr_receiveinline(REDIS rhnd, char *line)
 
 static int cr_receiveint(REDIS rhnd, char *line) 
 {
-  rhnd->reply.integer = atoi(line);
+  rhnd->reply.integer = strtoll(line, NULL, 10);
   return 0;
 }
 
@@ -426,15 +674,19 @@ static int cr_receiveerror(REDIS rhnd, char *line)
   return CREDIS_ERR_PROTOCOL;
 }
 
-static int cr_receivereply(REDIS rhnd, char recvtype) 
+/* Receives the next reply, starting at the current read position of the
+ * buffer. */
+static int cr_receivenext(REDIS rhnd, char recvtype) 
 {
   char *line, prefix=0;
+  int rc;
 
-  /* reset common send/receive buffer */
-  rhnd->buf.len = 0;
-  rhnd->buf.idx = 0;
+  rhnd->reply.line = NULL;
 
-  if (cr_readln(rhnd, 0, &line, NULL) > 0) {
+  if ((rc = cr_readln(rhnd, 0, &line, NULL)) < 0)
+    return cr_readerror(rc);
+
+  if (rc > 0) {
     prefix = *(line++);
  
     if (prefix != recvtype && prefix != CR_ERROR)
@@ -457,6 +709,15 @@ static int cr_receivereply(REDIS rhnd, char recvtype)
   return CREDIS_ERR_RECV;
 }
 
+static int cr_receivereply(REDIS rhnd, char recvtype) 
+{
+  /* reset common send/receive buffer */
+  rhnd->buf.len = 0;
+  rhnd->buf.idx = 0;
+
+  return cr_receivenext(rhnd, recvtype);
+}
+
 static void cr_delete(REDIS rhnd) 
 {
   if (rhnd->reply.multibulk.bulks != NULL)
@@ -496,9 +757,33 @@ static int cr_sendandreceive(REDIS rhnd, char recvtype)
 {
   int rc;
 
+  /* no error reply from the server yet */
+  rhnd->reply.line = NULL;
+
+  /* replies to pipelined commands must be read first */
+  if (rhnd->pipelined > 0)
+    return CREDIS_ERR;
+
+  /* closed by a failed pipeline flush */
+  if (rhnd->fd < 0)
+    return CREDIS_ERR_SEND;
+
   DEBUG("Sending message: len=%d, data=%s", rhnd->buf.len, rhnd->buf.data);
 
-  rc = cr_senddata(rhnd->fd, rhnd->timeout, rhnd->buf.data, rhnd->buf.len);
+  /* one deadline for sending the command and receiving all of its reply */
+  rhnd->deadline = cr_now() + rhnd->timeout;
+
+#ifdef CREDIS_FAULTS
+  /* answered as if by the server, the connection stays in sync */
+  if (cr_faulterror()) {
+    rhnd->reply.line = (char *)"ERR injected by credis";
+    return CREDIS_ERR_PROTOCOL;
+  }
+#endif
+
+  PROBE3(send__start, rhnd->fd, rhnd->buf.data, rhnd->buf.len);
+  rc = cr_senddata(rhnd->fd, rhnd->deadline, rhnd->buf.data, rhnd->buf.len);
+  PROBE2(send__done, rhnd->fd, rc);
 
   if (rc != rhnd->buf.len) {
     if (rc < 0)
@@ -506,34 +791,57 @@ static int cr_sendandreceive(REDIS rhnd, char recvtype)
     return CREDIS_ERR_TIMEOUT;
   }
 
-  return cr_receivereply(rhnd, recvtype);
+  PROBE2(receive__start, rhnd->fd, recvtype);
+  rc = cr_receivereply(rhnd, recvtype);
+  PROBE2(receive__done, rhnd->fd, rc);
+
+  return rc;
 }
 
-/* Prepare message buffer for sending using a printf()-style formatting. */
-static int cr_sendfandreceive(REDIS rhnd, char recvtype, const char *format, ...)
+/* Prepare message buffer for sending as a multi-bulk request built from 
+ * the `argc' zero-terminated strings that follow `argc'. */
+static int cr_sendstrvandreceive(REDIS rhnd, char recvtype, int argc, ...)
 {
-  int rc;
-  va_list ap;
   cr_buffer *buf = &(rhnd->buf);
+  const char *arg;
+  va_list ap;
+  int rc = 0, i;
+
+  buf->len = 0;
 
-  va_start(ap, format);
-  rc = vsnprintf(buf->data, buf->size, format, ap);
+  if ((rc = cr_appendcount(buf, argc)) != 0)
+    return rc;
+
+  va_start(ap, argc);
+  for (i = 0; i < argc && rc == 0; i++) {
+    arg = va_arg(ap, const char *);
+    rc = cr_appendarg(buf, arg, strlen(arg));
+  }
   va_end(ap);
 
-  if (rc < 0)
-    return -1;
+  if (rc != 0)
+    return rc;
 
-  if (rc >= buf->size) {
-    DEBUG("truncated, get more memory and try again");
-    if (cr_moremem(buf, rc - buf->size + 1))
-      return CREDIS_ERR_NOMEM;
+  return cr_sendandreceive(rhnd, recvtype);
+}
 
-    va_start(ap, format);
-    rc = vsnprintf(buf->data, buf->size, format, ap);
-    va_end(ap);
-  }
+/* Prepare message buffer for sending as a multi-bulk request built from 
+ * `argc' arguments in `argv', optionally followed by `keyc' keys in `keyv' 
+ * and `valc' values in `valv'. Arguments are sent length-prefixed, so they
+ * may contain spaces and newlines. */
+static int cr_sendargvandreceive(REDIS rhnd, char recvtype, int argc, const char **argv,
+                                 int keyc, const char **keyv, int valc, const char **valv)
+{
+  cr_buffer *buf = &(rhnd->buf);
+  int rc;
 
-  buf->len = rc;
+  buf->len = 0;
+
+  if ((rc = cr_appendcount(buf, argc + keyc + valc)) != 0 ||
+      (rc = cr_appendargv(buf, argc, argv, NULL)) != 0 ||
+      (rc = cr_appendargv(buf, keyc, keyv, NULL)) != 0 ||
+      (rc = cr_appendargv(buf, valc, valv, NULL)) != 0)
+    return rc;
 
   return cr_sendandreceive(rhnd, recvtype);
 }
@@ -545,35 +853,93 @@ void credis_close(REDIS rhnd)
   cr_delete(rhnd);
 }
 
-REDIS credis_connect(const char *host, int port, int timeout)
+/* Connects socket `fd' to `sa', giving up after `msecs' milliseconds 
+ * rather than waiting for the TCP connect timeout of the system. 
+ * Returns:
+ *   0  on success
+ *  -1  on error or timeout */
+static int cr_connect(int fd, struct sockaddr_in *sa, int msecs)
 {
-  int fd, yes = 1;
-  struct sockaddr_in sa;  
-  REDIS rhnd;
+  int flags, err = 0;
+  socklen_t len = sizeof(err);
 
-  if ((rhnd = cr_new()) == NULL)
-    return NULL;
+  if ((flags = fcntl(fd, F_GETFL, 0)) == -1 ||
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    return -1;
+
+  if (connect(fd, (struct sockaddr*)sa, sizeof(*sa)) == -1) {
+    if (errno != EINPROGRESS ||
+        cr_poll(fd, POLLOUT, cr_now() + msecs) <= 0 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 ||
+        err != 0)
+      return -1;
+  }
+
+  /* back to blocking, reads and writes are guarded by cr_poll() */
+  if (fcntl(fd, F_SETFL, flags) == -1)
+    return -1;
+
+  return 0;
+}
 
+/* Fills in `sa' with the address of `host' and `port', using defaults for
+ * NULL and 0 respectively.
+ * Returns:
+ *   0  on success
+ *  -1  on error, i.e. host could not be resolved */
+static int cr_resolve(const char *host, int port, struct sockaddr_in *sa)
+{
   if (host == NULL)
     host = "127.0.0.1";
   if (port == 0)
     port = 6379;
 
-  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
-      setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes)) == -1 ||
-      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1)
-    goto error;
-
-  sa.sin_family = AF_INET;
-  sa.sin_port = htons(port);
-  if (inet_aton(host, &sa.sin_addr) == 0) {
+  memset(sa, 0, sizeof(*sa));
+  sa->sin_family = AF_INET;
+  sa->sin_port = htons(port);
+  if (inet_aton(host, &sa->sin_addr) == 0) {
     struct hostent *he = gethostbyname(host);
     if (he == NULL)
-      goto error;
-    memcpy(&sa.sin_addr, he->h_addr, sizeof(struct in_addr));
+      return -1;
+    memcpy(&sa->sin_addr, he->h_addr, sizeof(struct in_addr));
+  }
+
+  return 0;
+}
+
+/* Returns a new TCP socket connected to `sa' with keepalive and Nagle 
+ * disabled, or -1 on error or timeout */
+static int cr_socket(struct sockaddr_in *sa, int msecs)
+{
+  int fd, yes = 1;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    return -1;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes)) == -1 ||
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1 ||
+      cr_connect(fd, sa, msecs) != 0) {
+    close(fd);
+    return -1;
   }
 
-  if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1)
+  return fd;
+}
+
+REDIS credis_connect(const char *host, int port, int timeout)
+{
+  int fd = -1;
+  struct sockaddr_in sa;  
+  REDIS rhnd;
+
+  if ((rhnd = cr_new()) == NULL)
+    return NULL;
+
+  if (port == 0)
+    port = 6379;
+
+  if (cr_resolve(host, port, &sa) != 0 ||
+      (fd = cr_socket(&sa, timeout)) == -1)
     goto error;
 
   strcpy(rhnd->ip, inet_ntoa(sa.sin_addr));
@@ -592,13 +958,12 @@ REDIS credis_connect(const char *host, int port, int timeout)
 
 int credis_set(REDIS rhnd, const char *key, const char *val)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "SET %s %d\r\n%s\r\n", 
-                            key, strlen(val), val);
+  return cr_sendstrvandreceive(rhnd, CR_INLINE, 3, "SET", key, val);
 }
 
 int credis_get(REDIS rhnd, const char *key, char **val)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_BULK, "GET %s\r\n", key);
+  int rc = cr_sendstrvandreceive(rhnd, CR_BULK, 2, "GET", key);
 
   if (rc == 0)
     if ((*val = rhnd->reply.bulk) == NULL)
@@ -609,8 +974,7 @@ int credis_get(REDIS rhnd, const char *key, char **val)
 
 int credis_getset(REDIS rhnd, const char *key, const char *set_val, char **get_val)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_BULK, "GETSET %s %d\r\n%s\r\n", 
-                              key, strlen(set_val), set_val);
+  int rc = cr_sendstrvandreceive(rhnd, CR_BULK, 3, "GETSET", key, set_val);
 
   if (rc == 0)
     if ((*get_val = rhnd->reply.bulk) == NULL)
@@ -621,26 +985,25 @@ int credis_getset(REDIS rhnd, const char *key, const char *set_val, char **get_v
 
 int credis_ping(REDIS rhnd) 
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "PING\r\n");
+  return cr_sendstrvandreceive(rhnd, CR_INLINE, 1, "PING");
+}
+
+const char *credis_errorreply(REDIS rhnd)
+{
+  return rhnd->reply.line;
 }
 
 int credis_auth(REDIS rhnd, const char *password)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "AUTH %s\r\n", password);
+  return cr_sendstrvandreceive(rhnd, CR_INLINE, 2, "AUTH", password);
 }
 
 int cr_multikeybulkcommand(REDIS rhnd, const char *cmd, int keyc, 
                            const char **keyv, char ***valv)
 {
-  cr_buffer *buf = &(rhnd->buf);
   int rc;
 
-  buf->len = 0;
-  if ((rc = cr_appendstr(buf, cmd, 0)) != 0)
-    return rc;
-  if ((rc = cr_appendstrarray(buf, keyc, keyv, 1)) != 0)
-    return rc;
-  if ((rc = cr_sendandreceive(rhnd, CR_MULTIBULK)) == 0) {
+  if ((rc = cr_sendargvandreceive(rhnd, CR_MULTIBULK, 1, &cmd, keyc, keyv, 0, NULL)) == 0) {
     *valv = rhnd->reply.multibulk.bulks;
     rc = rhnd->reply.multibulk.len;
   }
@@ -651,18 +1014,9 @@ int cr_multikeybulkcommand(REDIS rhnd, const char *cmd, int keyc,
 int cr_multikeystorecommand(REDIS rhnd, const char *cmd, const char *destkey, 
                             int keyc, const char **keyv)
 {
-  cr_buffer *buf = &(rhnd->buf);
-  int rc;
-
-  buf->len = 0;
-  if ((rc = cr_appendstr(buf, cmd, 0)) != 0)
-    return rc;
-  if ((rc = cr_appendstr(buf, destkey, 1)) != 0)
-    return rc;
-  if ((rc = cr_appendstrarray(buf, keyc, keyv, 1)) != 0)
-    return rc;
+  const char *argv[2] = {cmd, destkey};
 
-  return cr_sendandreceive(rhnd, CR_INLINE);
+  return cr_sendargvandreceive(rhnd, CR_INLINE, 2, argv, keyc, keyv, 0, NULL);
 }
 
 int credis_mget(REDIS rhnd, int keyc, const char **keyv, char ***valv)
@@ -672,8 +1026,7 @@ int credis_mget(REDIS rhnd, int keyc, const char **keyv, char ***valv)
 
 int credis_setnx(REDIS rhnd, const char *key, const char *val)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "SETNX %s %d\r\n%s\r\n", 
-                              key, strlen(val), val);
+  int rc = cr_sendstrvandreceive(rhnd, CR_INT, 3, "SETNX", key, val);
 
   if (rc == 0)
     if (rhnd->reply.integer == 0)
@@ -684,17 +1037,17 @@ int credis_setnx(REDIS rhnd, const char *key, const char *val)
 
 static int cr_incr(REDIS rhnd, int incr, int decr, const char *key, int *new_val)
 {
+  char num[CR_INT_STRING_SIZE];
   int rc = 0;
 
   if (incr == 1 || decr == 1)
-    rc = cr_sendfandreceive(rhnd, CR_INT, "%s %s\r\n", 
-                            incr>0?"INCR":"DECR", key);
+    rc = cr_sendstrvandreceive(rhnd, CR_INT, 2, incr>0?"INCR":"DECR", key);
   else if (incr > 1 || decr > 1)
-    rc = cr_sendfandreceive(rhnd, CR_INT, "%s %s %d\r\n", 
-                            incr>0?"INCRBY":"DECRBY", key, incr>0?incr:decr);
+    rc = cr_sendstrvandreceive(rhnd, CR_INT, 3, incr>0?"INCRBY":"DECRBY", key, 
+                               cr_itoa(incr>0?incr:decr, num));
 
   if (rc == 0 && new_val != NULL)
-    *new_val = rhnd->reply.integer;
+    *new_val = (int)rhnd->reply.integer;
 
   return rc;
 }
@@ -709,30 +1062,65 @@ int credis_decr(REDIS rhnd, const char *key, int *new_val)
   return cr_incr(rhnd, 0, 1, key, new_val);
 }
 
-int credis_incrby(REDIS rhnd, const char *key, int incr_val, int *new_val)
+/* INCRBY/DECRBY are always sent as such, also for values < 2, so that the
+ * reply (and `new_val') reflects the current value of the key */
+static int cr_incrby(REDIS rhnd, const char *cmd, const char *key, long long val, long long *new_val)
 {
-  return cr_incr(rhnd, incr_val, 0, key, new_val);
-}
+  char num[CR_INT_STRING_SIZE];
+  int rc = cr_sendstrvandreceive(rhnd, CR_INT, 3, cmd, key, cr_itoa(val, num));
 
-int credis_decrby(REDIS rhnd, const char *key, int decr_val, int *new_val)
-{
-  return cr_incr(rhnd, 0, decr_val, key, new_val);
+  if (rc == 0 && new_val != NULL)
+    *new_val = rhnd->reply.integer;
+
+  return rc;
 }
 
-int credis_exists(REDIS rhnd, const char *key)
+int credis_incrby(REDIS rhnd, const char *key, int incr_val, int *new_val)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "EXISTS %s\r\n", key);
+  long long val;
+  int rc = cr_incrby(rhnd, "INCRBY", key, incr_val, &val);
 
-  if (rc == 0)
-    if (rhnd->reply.integer == 0)
-      rc = -1;
+  if (rc == 0 && new_val != NULL)
+    *new_val = (int)val;
 
   return rc;
 }
 
-int credis_del(REDIS rhnd, const char *key)
+int credis_decrby(REDIS rhnd, const char *key, int decr_val, int *new_val)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "DEL %s\r\n", key);
+  long long val;
+  int rc = cr_incrby(rhnd, "DECRBY", key, decr_val, &val);
+
+  if (rc == 0 && new_val != NULL)
+    *new_val = (int)val;
+
+  return rc;
+}
+
+int credis_incrby64(REDIS rhnd, const char *key, long long incr_val, long long *new_val)
+{
+  return cr_incrby(rhnd, "INCRBY", key, incr_val, new_val);
+}
+
+int credis_decrby64(REDIS rhnd, const char *key, long long decr_val, long long *new_val)
+{
+  return cr_incrby(rhnd, "DECRBY", key, decr_val, new_val);
+}
+
+int credis_exists(REDIS rhnd, const char *key)
+{
+  int rc = cr_sendstrvandreceive(rhnd, CR_INT, 2, "EXISTS", key);
+
+  if (rc == 0)
+    if (rhnd->reply.integer == 0)
+      rc = -1;
+
+  return rc;
+}
+
+int credis_del(REDIS rhnd, const char *key)
+{
+  int rc = cr_sendstrvandreceive(rhnd, CR_INT, 2, "DEL", key);
 
   if (rc == 0)
     if (rhnd->reply.integer == 0)
@@ -743,7 +1131,7 @@ int credis_del(REDIS rhnd, const char *key)
 
 int credis_type(REDIS rhnd, const char *key)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INLINE, "TYPE %s\r\n", key);
+  int rc = cr_sendstrvandreceive(rhnd, CR_INLINE, 2, "TYPE", key);
 
   if (rc == 0) {
     char *t = rhnd->reply.bulk;
@@ -762,7 +1150,7 @@ int credis_type(REDIS rhnd, const char *key)
 
 int credis_keys(REDIS rhnd, const char *pattern, char **keyv, int len)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_BULK, "KEYS %s\r\n", pattern);
+  int rc = cr_sendstrvandreceive(rhnd, CR_BULK, 2, "KEYS", pattern);
   char *p = rhnd->reply.bulk;
   int i = 0;
 
@@ -785,7 +1173,7 @@ int credis_keys(REDIS rhnd, const char *pattern, char **keyv, int len)
 
 int credis_randomkey(REDIS rhnd, char **key)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INLINE, "RANDOMKEY\r\n");
+  int rc = cr_sendstrvandreceive(rhnd, CR_INLINE, 1, "RANDOMKEY");
 
   if (rc == 0) 
     *key = rhnd->reply.line;
@@ -795,14 +1183,12 @@ int credis_randomkey(REDIS rhnd, char **key)
 
 int credis_rename(REDIS rhnd, const char *key, const char *new_key_name)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "RENAME %s %s\r\n", 
-                            key, new_key_name);
+  return cr_sendstrvandreceive(rhnd, CR_INLINE, 3, "RENAME", key, new_key_name);
 }
 
 int credis_renamenx(REDIS rhnd, const char *key, const char *new_key_name)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "RENAMENX %s %s\r\n", 
-                              key, new_key_name);
+  int rc = cr_sendstrvandreceive(rhnd, CR_INT, 3, "RENAMENX", key, new_key_name);
 
   if (rc == 0)
     if (rhnd->reply.integer == 0)
@@ -813,17 +1199,18 @@ int credis_renamenx(REDIS rhnd, const char *key, const char *new_key_name)
 
 int credis_dbsize(REDIS rhnd)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "DBSIZE\r\n");
+  int rc = cr_sendstrvandreceive(rhnd, CR_INT, 1, "DBSIZE");
 
   if (rc == 0) 
-    rc = rhnd->reply.integer;
+    rc = (int)rhnd->reply.integer;
 
   return rc;
 }
 
 int credis_expire(REDIS rhnd, const char *key, int secs)
 { 
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "EXPIRE %s %d\r\n", key, secs);
+  char num[CR_INT_STRING_SIZE];
+  int rc = cr_sendstrvandreceive(rhnd, CR_INT, 3, "EXPIRE", key, cr_itoa(secs, num));
 
   if (rc == 0)
     if (rhnd->reply.integer == 0)
@@ -834,18 +1221,17 @@ int credis_expire(REDIS rhnd, const char *key, int secs)
 
 int credis_ttl(REDIS rhnd, const char *key)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "TTL %s\r\n", key);
+  int rc = cr_sendstrvandreceive(rhnd, CR_INT, 2, "TTL", key);
 
   if (rc == 0)
-    rc = rhnd->reply.integer;
+    rc = (int)rhnd->reply.integer;
 
   return rc;
 }
 
 int cr_push(REDIS rhnd, int left, const char *key, const char *val)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "%s %s %d\r\n%s\r\n", 
-                            left==1?"LPUSH":"RPUSH", key, strlen(val), val);
+  return cr_sendstrvandreceive(rhnd, CR_INLINE, 3, left==1?"LPUSH":"RPUSH", key, val);
 }
 
 int credis_rpush(REDIS rhnd, const char *key, const char *val)
@@ -860,20 +1246,21 @@ int credis_lpush(REDIS rhnd, const char *key, const char *val)
 
 int credis_llen(REDIS rhnd, const char *key)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "LLEN %s\r\n", key);
+  int rc = cr_sendstrvandreceive(rhnd, CR_INT, 2, "LLEN", key);
 
   if (rc == 0) 
-    rc = rhnd->reply.integer;
+    rc = (int)rhnd->reply.integer;
 
   return rc;
 }
 
 int credis_lrange(REDIS rhnd, const char *key, int start, int end, char ***valv)
 {
+  char num1[CR_INT_STRING_SIZE], num2[CR_INT_STRING_SIZE];
   int rc;
 
-  if ((rc = cr_sendfandreceive(rhnd, CR_MULTIBULK, "LRANGE %s %d %d\r\n", 
-                               key, start, end)) == 0) {
+  if ((rc = cr_sendstrvandreceive(rhnd, CR_MULTIBULK, 4, "LRANGE", key, 
+                                  cr_itoa(start, num1), cr_itoa(end, num2))) == 0) {
     *valv = rhnd->reply.multibulk.bulks;
     rc = rhnd->reply.multibulk.len;
   }
@@ -883,13 +1270,16 @@ int credis_lrange(REDIS rhnd, const char *key, int start, int end, char ***valv)
 
 int credis_ltrim(REDIS rhnd, const char *key, int start, int end)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "LTRIM %s %d %d\r\n", 
-                            key, start, end);
+  char num1[CR_INT_STRING_SIZE], num2[CR_INT_STRING_SIZE];
+
+  return cr_sendstrvandreceive(rhnd, CR_INLINE, 4, "LTRIM", key, 
+                               cr_itoa(start, num1), cr_itoa(end, num2));
 }
 
 int credis_lindex(REDIS rhnd, const char *key, int index, char **val)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_BULK, "LINDEX %s %d\r\n", key, index);
+  char num[CR_INT_STRING_SIZE];
+  int rc = cr_sendstrvandreceive(rhnd, CR_BULK, 3, "LINDEX", key, cr_itoa(index, num));
 
   if (rc == 0)
     if ((*val = rhnd->reply.bulk) == NULL)
@@ -900,18 +1290,21 @@ int credis_lindex(REDIS rhnd, const char *key, int index, char **val)
 
 int credis_lset(REDIS rhnd, const char *key, int index, const char *val)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "LSET %s %d %s\r\n", key, index, val);
+  char num[CR_INT_STRING_SIZE];
+
+  return cr_sendstrvandreceive(rhnd, CR_INLINE, 4, "LSET", key, cr_itoa(index, num), val);
 }
 
 int credis_lrem(REDIS rhnd, const char *key, int count, const char *val)
 {
-  return cr_sendfandreceive(rhnd, CR_INT, "LREM %s %d %d\r\n", key, count, val);
+  char num[CR_INT_STRING_SIZE];
+
+  return cr_sendstrvandreceive(rhnd, CR_INT, 4, "LREM", key, cr_itoa(count, num), val);
 }
 
 static int cr_pop(REDIS rhnd, int left, const char *key, char **val)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_BULK, "%s %s\r\n", 
-                              left==1?"LPOP":"RPOP", key);
+  int rc = cr_sendstrvandreceive(rhnd, CR_BULK, 2, left==1?"LPOP":"RPOP", key);
 
   if (rc == 0)
     if ((*val = rhnd->reply.bulk) == NULL)
@@ -932,12 +1325,15 @@ int credis_rpop(REDIS rhnd, const char *key, char **val)
 
 int credis_select(REDIS rhnd, int index)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "SELECT %d\r\n", index);
+  char num[CR_INT_STRING_SIZE];
+
+  return cr_sendstrvandreceive(rhnd, CR_INLINE, 2, "SELECT", cr_itoa(index, num));
 }
 
 int credis_move(REDIS rhnd, const char *key, int index)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "MOVE %s %d\r\n", key, index);
+  char num[CR_INT_STRING_SIZE];
+  int rc = cr_sendstrvandreceive(rhnd, CR_INT, 3, "MOVE", key, cr_itoa(index, num));
 
   if (rc == 0)
     if (rhnd->reply.integer == 0)
@@ -948,19 +1344,45 @@ int credis_move(REDIS rhnd, const char *key, int index)
 
 int credis_flushdb(REDIS rhnd)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "FLUSHDB\r\n");
+  return cr_sendstrvandreceive(rhnd, CR_INLINE, 1, "FLUSHDB");
 }
 
 int credis_flushall(REDIS rhnd)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "FLUSHALL\r\n");
+  return cr_sendstrvandreceive(rhnd, CR_INLINE, 1, "FLUSHALL");
 }
 
 int credis_sort(REDIS rhnd, const char *query, char ***elementv)
 {
-  int rc;
+  cr_buffer *buf = &(rhnd->buf);
+  const char *p, *end;
+  int rc, argc = 1;
+
+  /* `query' is sent as one argument per space separated word */
+  for (p = query; *p; p = end) {
+    while (*p == ' ')
+      p++;
+    for (end = p; *end && *end != ' '; end++)
+      ;
+    if (end > p)
+      argc++;
+  }
 
-  if ((rc = cr_sendfandreceive(rhnd, CR_MULTIBULK, "SORT %s\r\n", query)) == 0) {
+  buf->len = 0;
+  if ((rc = cr_appendcount(buf, argc)) != 0 ||
+      (rc = cr_appendarg(buf, "SORT", 4)) != 0)
+    return rc;
+
+  for (p = query; *p; p = end) {
+    while (*p == ' ')
+      p++;
+    for (end = p; *end && *end != ' '; end++)
+      ;
+    if (end > p && (rc = cr_appendarg(buf, p, end - p)) != 0)
+      return rc;
+  }
+
+  if ((rc = cr_sendandreceive(rhnd, CR_MULTIBULK)) == 0) {
     *elementv = rhnd->reply.multibulk.bulks;
     rc = rhnd->reply.multibulk.len;
   }
@@ -970,34 +1392,34 @@ int credis_sort(REDIS rhnd, const char *query, char ***elementv)
 
 int credis_save(REDIS rhnd)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "SAVE\r\n");
+  return cr_sendstrvandreceive(rhnd, CR_INLINE, 1, "SAVE");
 }
 
 int credis_bgsave(REDIS rhnd)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "BGSAVE\r\n");
+  return cr_sendstrvandreceive(rhnd, CR_INLINE, 1, "BGSAVE");
 }
 
 int credis_lastsave(REDIS rhnd)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "LASTSAVE\r\n");
+  int rc = cr_sendstrvandreceive(rhnd, CR_INT, 1, "LASTSAVE");
 
   if (rc == 0)
-    rc = rhnd->reply.integer;
+    rc = (int)rhnd->reply.integer;
 
   return rc;
 }
 
 int credis_shutdown(REDIS rhnd)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "SHUTDOWN\r\n");
+  return cr_sendstrvandreceive(rhnd, CR_INLINE, 1, "SHUTDOWN");
 }
 
 #define CR_NUMBER_OF_ITEMS 12
 
 int credis_info(REDIS rhnd, REDIS_INFO *info)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_BULK, "INFO\r\n");
+  int rc = cr_sendstrvandreceive(rhnd, CR_BULK, 1, "INFO");
 
   if (rc == 0) {
     char role[CREDIS_VERSION_STRING_SIZE];
@@ -1038,21 +1460,22 @@ int credis_info(REDIS rhnd, REDIS_INFO *info)
 
 int credis_monitor(REDIS rhnd)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "MONITOR\r\n");
+  return cr_sendstrvandreceive(rhnd, CR_INLINE, 1, "MONITOR");
 }
 
 int credis_slaveof(REDIS rhnd, const char *host, int port)
 {
+  char num[CR_INT_STRING_SIZE];
+
   if (host == NULL || port == 0)
-    return cr_sendfandreceive(rhnd, CR_INLINE, "SLAVEOF no one\r\n");
+    return cr_sendstrvandreceive(rhnd, CR_INLINE, 3, "SLAVEOF", "no", "one");
   else
-    return cr_sendfandreceive(rhnd, CR_INLINE, "SLAVEOF %s %d\r\n", host, port);
+    return cr_sendstrvandreceive(rhnd, CR_INLINE, 3, "SLAVEOF", host, cr_itoa(port, num));
 }
 
 static int cr_setaddrem(REDIS rhnd, const char *cmd, const char *key, const char *member)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "%s %s %d\r\n%s\r\n", 
-                              cmd, key, strlen(member), member);
+  int rc = cr_sendstrvandreceive(rhnd, CR_INT, 3, cmd, key, member);
 
   if (rc == 0)
     if (rhnd->reply.integer == 0)
@@ -1073,7 +1496,7 @@ int credis_srem(REDIS rhnd, const char *key, const char *member)
 
 int credis_spop(REDIS rhnd, const char *key, char **member)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_BULK, "SPOP %s\r\n", key);
+  int rc = cr_sendstrvandreceive(rhnd, CR_BULK, 2, "SPOP", key);
 
   if (rc == 0)
     if ((*member = rhnd->reply.bulk) == NULL)
@@ -1085,8 +1508,7 @@ int credis_spop(REDIS rhnd, const char *key, char **member)
 int credis_smove(REDIS rhnd, const char *sourcekey, const char *destkey, 
                  const char *member)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "SMOVE %s %s %s\r\n", 
-                              sourcekey, destkey, member);
+  int rc = cr_sendstrvandreceive(rhnd, CR_INT, 4, "SMOVE", sourcekey, destkey, member);
 
   if (rc == 0)
     if (rhnd->reply.integer == 0)
@@ -1097,10 +1519,10 @@ int credis_smove(REDIS rhnd, const char *sourcekey, const char *destkey,
 
 int credis_scard(REDIS rhnd, const char *key) 
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "SCARD %s\r\n", key);
+  int rc = cr_sendstrvandreceive(rhnd, CR_INT, 2, "SCARD", key);
 
   if (rc == 0)
-    rc = rhnd->reply.integer;
+    rc = (int)rhnd->reply.integer;
 
   return rc;
 }
@@ -1144,3 +1566,777 @@ int credis_smembers(REDIS rhnd, const char *key, char ***members)
 {
   return cr_multikeybulkcommand(rhnd, "SMEMBERS", 1, &key, members);
 }
+
+int credis_script_load(REDIS rhnd, const char *script, char **sha)
+{
+  const char *argv[3] = {"SCRIPT", "LOAD", script};
+  int rc = cr_sendargvandreceive(rhnd, CR_BULK, 3, argv, 0, NULL, 0, NULL);
+
+  if (rc == 0)
+    if ((*sha = rhnd->reply.bulk) == NULL)
+      return -1;
+
+  return rc;
+}
+
+static int cr_eval(REDIS rhnd, const char *cmd, const char *script, int keyc, 
+                   const char **keyv, int argc, const char **argv, char ***valv)
+{
+  char numkeys[CR_INT_STRING_SIZE];
+  const char *cmdv[3] = {cmd, script, cr_itoa(keyc, numkeys)};
+  int rc;
+
+  rc = cr_sendargvandreceive(rhnd, CR_MULTIBULK, 3, cmdv, keyc, keyv, argc, argv);
+
+  if (rc == CREDIS_ERR_PROTOCOL && rhnd->reply.line != NULL &&
+      !strncmp(rhnd->reply.line, "NOSCRIPT", 8))
+    return CREDIS_ERR_NOSCRIPT;
+
+  if (rc == 0) {
+    *valv = rhnd->reply.multibulk.bulks;
+    rc = rhnd->reply.multibulk.len;
+  }
+
+  return rc;
+}
+
+int credis_eval(REDIS rhnd, const char *script, int keyc, const char **keyv, 
+                int argc, const char **argv, char ***valv)
+{
+  return cr_eval(rhnd, "EVAL", script, keyc, keyv, argc, argv, valv);
+}
+
+int credis_evalsha(REDIS rhnd, const char *sha, int keyc, const char **keyv, 
+                   int argc, const char **argv, char ***valv)
+{
+  return cr_eval(rhnd, "EVALSHA", sha, keyc, keyv, argc, argv, valv);
+}
+
+int credis_pipeline_begin(REDIS rhnd)
+{
+  if (rhnd->pipelined > 0)
+    return CREDIS_ERR;
+
+  rhnd->buf.len = 0;
+  rhnd->buf.idx = 0;
+
+  return 0;
+}
+
+int credis_pipeline_append(REDIS rhnd, int argc, const char **argv, const int *argvlen)
+{
+  cr_buffer *buf = &(rhnd->buf);
+  int rc, len = buf->len;
+
+  if ((rc = cr_appendcount(buf, argc)) != 0 ||
+      (rc = cr_appendargv(buf, argc, argv, argvlen)) != 0) {
+    buf->len = len; /* drop partially appended command */
+    return rc;
+  }
+
+  rhnd->pipelined++;
+
+  return 0;
+}
+
+int credis_pipeline_flush(REDIS rhnd)
+{
+  int rc, len = rhnd->buf.len;
+
+  DEBUG("Sending %d pipelined commands: len=%d", rhnd->pipelined, len);
+
+  if (rhnd->pipelined == 0)
+    return 0;
+
+  if (rhnd->fd < 0)
+    rc = -1;
+  else {
+    rhnd->deadline = cr_now() + rhnd->timeout;
+    rc = cr_senddata(rhnd->fd, rhnd->deadline, rhnd->buf.data, len);
+  }
+
+  /* buffer is now used to receive replies */
+  rhnd->buf.len = 0;
+  rhnd->buf.idx = 0;
+
+  if (rc != len) {
+    /* the server may have got some of the commands, so their replies would
+     * turn up as replies to later commands. No reply is read, the 
+     * connection is closed and later commands fail */
+    rhnd->pipelined = 0;
+    if (rhnd->fd >= 0) {
+      close(rhnd->fd);
+      rhnd->fd = -1;
+    }
+    return rc < 0 ? CREDIS_ERR_SEND : CREDIS_ERR_TIMEOUT;
+  }
+
+  return rhnd->pipelined;
+}
+
+/* Reads the next pipelined reply. Data already received but belonging to
+ * later replies is moved to the start of the buffer first, which keeps 
+ * the buffer from growing with the number of pipelined commands. */
+static int cr_pipeline_read(REDIS rhnd, char recvtype)
+{
+  cr_buffer *buf = &(rhnd->buf);
+
+  if (rhnd->pipelined == 0)
+    return CREDIS_ERR;
+
+  if (buf->idx > 0) {
+    memmove(buf->data, buf->data + buf->idx, buf->len - buf->idx);
+    buf->len -= buf->idx;
+    buf->idx = 0;
+  }
+
+  rhnd->pipelined--;
+  rhnd->deadline = cr_now() + rhnd->timeout;
+
+  return cr_receivenext(rhnd, recvtype);
+}
+
+int credis_pipeline_read_int(REDIS rhnd, int *val)
+{
+  int rc = cr_pipeline_read(rhnd, CR_INT);
+
+  if (rc == 0 && val != NULL)
+    *val = (int)rhnd->reply.integer;
+
+  return rc;
+}
+
+int credis_pipeline_read_int64(REDIS rhnd, long long *val)
+{
+  int rc = cr_pipeline_read(rhnd, CR_INT);
+
+  if (rc == 0 && val != NULL)
+    *val = rhnd->reply.integer;
+
+  return rc;
+}
+
+int credis_pipeline_read_bulk(REDIS rhnd, char **val)
+{
+  int rc = cr_pipeline_read(rhnd, CR_BULK);
+
+  if (rc == 0)
+    if ((*val = rhnd->reply.bulk) == NULL)
+      return -1;
+
+  return rc;
+}
+
+int credis_pipeline_read_status(REDIS rhnd)
+{
+  return cr_pipeline_read(rhnd, CR_INLINE);
+}
+
+int credis_pipeline_read_multibulk(REDIS rhnd, char ***valv)
+{
+  int rc = cr_pipeline_read(rhnd, CR_MULTIBULK);
+
+  if (rc == 0) {
+    *valv = rhnd->reply.multibulk.bulks;
+    rc = rhnd->reply.multibulk.len;
+  }
+
+  return rc;
+}
+
+int credis_pipeline_pending(REDIS rhnd)
+{
+  return rhnd->pipelined;
+}
+
+#ifdef CREDIS_ASYNC
+
+/*
+ * Asynchronous client
+ *
+ * One I/O thread per handle owns all reading, writing and (re)connecting.
+ * Submitters only append encoded commands to the output buffer of a 
+ * connection and queue a request record, both guarded by the handle mutex,
+ * and poke the I/O thread through a pipe. Redis answers commands on a 
+ * connection in order, so each reply completes the oldest request queued
+ * on that connection.
+ */
+
+#define CR_ASYNC_MAXEVENTS 16
+#define CR_ASYNC_TICK 100       /* ms between checks for timeouts and reconnects */
+#define CR_ASYNC_RETRY 1000     /* ms between reconnect attempts */
+
+typedef struct _cr_async_req {
+  credis_async_cb cb;
+  void *privdata;
+  long long deadline;
+  struct _cr_async_req *next;
+} cr_async_req;
+
+typedef struct _cr_async_conn {
+  int fd;                       /* -1 while disconnected */
+  int connecting;               /* connect in progress, not yet used for commands */
+  int events;                   /* events registered with epoll */
+  long long retry;              /* when to attempt reconnecting, or to give up
+                                 * connecting, see cr_now() */
+  cr_buffer out;                /* commands not yet sent, `idx' bytes are sent */
+  cr_buffer in;                 /* replies received but not yet handled */
+  cr_async_req *head;           /* requests waiting for a reply, oldest first */
+  cr_async_req *tail;
+  int inflight;
+  cr_multibulk elements;        /* elements of the multi-bulk reply being handled */
+} cr_async_conn;
+
+typedef struct _cr_async {
+  struct sockaddr_in sa;
+  int timeout;
+  int nconns;
+  cr_async_conn *conns;
+  int epfd;
+  int wakeup[2];
+  int running;                  /* read and written with __atomic builtins */
+  int pending;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+} cr_async;
+
+/* Parses one reply from the `len' bytes at `data'. Nothing is modified
+ * unless the complete reply has been received. Strings of the reply are 
+ * zero-terminated in place and refer into `data'. Elements of multi-bulk 
+ * replies may be bulk, integer or status values.
+ * Returns:
+ *  >0  number of bytes making up the reply
+ *   0  reply not yet completely received
+ *  -1  on protocol error */
+static int cr_async_parse(cr_async_conn *conn, char *data, int len, REDIS_ASYNC_REPLY *reply)
+{
+  cr_multibulk *mb = &(conn->elements);
+  char *end = data + len, *p, *nl;
+  int n, i, blen;
+
+  if ((nl = cr_findnl(data, len)) == NULL)
+    return 0;
+
+  memset(reply, 0, sizeof(*reply));
+  reply->type = *data;
+  p = nl + 2;
+
+  switch (*data) {
+  case CR_INLINE:
+  case CR_ERROR:
+  case CR_INT:
+    *nl = '\0';
+    reply->str = data + 1;
+    reply->len = nl - data - 1;
+    if (*data == CR_INT)
+      reply->integer = strtoll(reply->str, NULL, 10);
+    return p - data;
+
+  case CR_BULK:
+    if ((blen = atoi(data + 1)) < 0)
+      return p - data;
+    if (end - p < blen + 2)
+      return 0;
+    p[blen] = '\0';
+    reply->str = p;
+    reply->len = blen;
+    return p + blen + 2 - data;
+
+  case CR_MULTIBULK:
+    if ((n = atoi(data + 1)) <= 0)
+      return p - data;
+    if (n > mb->size && cr_morebulk(mb, n - mb->size))
+      return -1;
+
+    for (i = 0; i < n; i++) {
+      if ((nl = cr_findnl(p, end - p)) == NULL)
+        return 0;
+
+      if (*p == CR_BULK) {
+        if ((blen = atoi(p + 1)) < 0) {
+          mb->bulks[i] = NULL;
+          p = nl + 2;
+          continue;
+        }
+        if (end - (nl + 2) < blen + 2)
+          return 0;
+        mb->bulks[i] = nl + 2;
+        mb->idxs[i] = blen;
+        p = nl + 2 + blen + 2;
+      }
+      else if (*p == CR_INT || *p == CR_INLINE) {
+        mb->bulks[i] = p + 1;
+        mb->idxs[i] = nl - p - 1;
+        p = nl + 2;
+      }
+      else
+        return -1;
+    }
+
+    /* complete, now it is safe to terminate the elements */
+    for (i = 0; i < n; i++)
+      if (mb->bulks[i] != NULL)
+        mb->bulks[i][mb->idxs[i]] = '\0';
+
+    reply->elements = n;
+    reply->element = mb->bulks;
+    return p - data;
+  }
+
+  return -1;
+}
+
+/* Registers interest in `events' for `conn' with epoll, if changed. */
+static void cr_async_watch(cr_async *ah, cr_async_conn *conn, int events)
+{
+  struct epoll_event ev;
+
+  if (conn->fd == -1 || conn->events == events)
+    return;
+
+  ev.events = events;
+  ev.data.ptr = conn;
+  if (epoll_ctl(ah->epfd, EPOLL_CTL_MOD, conn->fd, &ev) == 0)
+    conn->events = events;
+}
+
+/* Closes `conn' and completes all its requests, sent or not, with `rc'. 
+ * Called by the I/O thread without the handle mutex held. */
+static void cr_async_fail(cr_async *ah, cr_async_conn *conn, int rc)
+{
+  cr_async_req *req, *next;
+
+  DEBUG("connection failed, rc=%d, inflight=%d", rc, conn->inflight);
+
+  pthread_mutex_lock(&ah->mutex);
+  if (conn->fd != -1) {
+    epoll_ctl(ah->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  conn->connecting = 0;
+  conn->retry = cr_now() + CR_ASYNC_RETRY;
+  conn->out.len = conn->out.idx = 0;
+  conn->in.len = conn->in.idx = 0;
+  req = conn->head;
+  conn->head = conn->tail = NULL;
+  ah->pending -= conn->inflight;
+  conn->inflight = 0;
+  pthread_mutex_unlock(&ah->mutex);
+
+  for (; req != NULL; req = next) {
+    next = req->next;
+    req->cb(rc, NULL, req->privdata);
+    free(req);
+  }
+}
+
+/* Starts connecting `conn' without waiting for the server, which would
+ * hold up replies on the other connections. The connect completes on
+ * EPOLLOUT (see cr_async_connected()) or fails at the handle timeout. 
+ * Called by the I/O thread, or before it is started. */
+static void cr_async_open(cr_async *ah, cr_async_conn *conn)
+{
+  struct epoll_event ev;
+  int fd, yes = 1, connected;
+
+  conn->retry = cr_now() + CR_ASYNC_RETRY;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    return;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes)) == -1 ||
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1 ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+    close(fd);
+    return;
+  }
+
+  if ((connected = connect(fd, (struct sockaddr *)&ah->sa, sizeof(ah->sa))) == -1 &&
+      errno != EINPROGRESS) {
+    close(fd);
+    return;
+  }
+
+  ev.events = connected == 0 ? EPOLLIN : EPOLLOUT;
+  ev.data.ptr = conn;
+  if (epoll_ctl(ah->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    close(fd);
+    return;
+  }
+
+  pthread_mutex_lock(&ah->mutex);
+  conn->fd = fd;
+  conn->events = ev.events;
+  if ((conn->connecting = (connected != 0)))
+    conn->retry = cr_now() + ah->timeout;
+  pthread_mutex_unlock(&ah->mutex);
+}
+
+/* Completes the connect of `conn' once its socket turned writable.
+ * Returns:
+ *   0  on success
+ *  <0  on error, the connection must be failed with this code */
+static int cr_async_connected(cr_async *ah, cr_async_conn *conn)
+{
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0)
+    return CREDIS_ERR_CONNECT;
+
+  pthread_mutex_lock(&ah->mutex);
+  conn->connecting = 0;
+  cr_async_watch(ah, conn, EPOLLIN);
+  pthread_mutex_unlock(&ah->mutex);
+
+  return 0;
+}
+
+/* Sends as much pending output of `conn' as the socket takes and watches
+ * for writability while output remains. Called with the mutex held.
+ * Returns:
+ *   0  on success
+ *  -1  on error */
+static int cr_async_write(cr_async *ah, cr_async_conn *conn)
+{
+  cr_buffer *buf = &(conn->out);
+  int rc;
+
+  while (buf->idx < buf->len) {
+    rc = send(conn->fd, buf->data + buf->idx, buf->len - buf->idx, MSG_NOSIGNAL);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return -1;
+    }
+    buf->idx += rc;
+  }
+
+  if (buf->idx == buf->len) {
+    buf->idx = buf->len = 0;
+    cr_async_watch(ah, conn, EPOLLIN);
+  }
+  else
+    cr_async_watch(ah, conn, EPOLLIN | EPOLLOUT);
+
+  return 0;
+}
+
+/* Receives what is available on `conn' and completes a request for each
+ * complete reply. Called by the I/O thread without the mutex held.
+ * Returns:
+ *   0  on success
+ *  <0  on error, the connection must be failed with this code */
+static int cr_async_read(cr_async *ah, cr_async_conn *conn)
+{
+  cr_buffer *buf = &(conn->in);
+  REDIS_ASYNC_REPLY reply;
+  cr_async_req *req;
+  int rc;
+
+  for (;;) {
+    /* keep one spare byte for the terminating zero */
+    if (buf->size - buf->len < CR_BUFFER_WATERMARK && 
+        cr_moremem(buf, CR_BUFFER_SIZE))
+      return CREDIS_ERR_NOMEM;
+
+#ifdef CREDIS_FAULTS
+    cr_faultdelay(0);
+#endif
+    rc = cr_recv(conn->fd, buf->data + buf->len, buf->size - buf->len - 1);
+    if (rc == 0)
+      return CREDIS_ERR_RECV;
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return CREDIS_ERR_RECV;
+    }
+    buf->len += rc;
+    buf->data[buf->len] = '\0';
+
+    while ((rc = cr_async_parse(conn, buf->data + buf->idx, buf->len - buf->idx, &reply)) > 0) {
+      buf->idx += rc;
+
+      pthread_mutex_lock(&ah->mutex);
+      if ((req = conn->head) != NULL) {
+        if ((conn->head = req->next) == NULL)
+          conn->tail = NULL;
+        conn->inflight--;
+        ah->pending--;
+      }
+      pthread_mutex_unlock(&ah->mutex);
+
+      if (req == NULL)
+        return CREDIS_ERR_PROTOCOL;
+
+      req->cb(reply.type == CR_ERROR ? CREDIS_ERR_PROTOCOL : 0, &reply, req->privdata);
+      free(req);
+    }
+
+    if (rc < 0)
+      return CREDIS_ERR_PROTOCOL;
+
+    /* keep the unparsed rest of a reply at the start of the buffer */
+    if (buf->idx > 0) {
+      memmove(buf->data, buf->data + buf->idx, buf->len - buf->idx);
+      buf->len -= buf->idx;
+      buf->idx = 0;
+    }
+  }
+
+  return 0;
+}
+
+/* Wakes up the I/O thread. A full pipe means it is due to wake up anyway. */
+static void cr_async_wakeup(cr_async *ah)
+{
+  ssize_t rc;
+
+  do {
+    rc = write(ah->wakeup[1], "", 1);
+  } while (rc < 0 && errno == EINTR);
+}
+
+static void *cr_async_thread(void *arg)
+{
+  cr_async *ah = arg;
+  struct epoll_event events[CR_ASYNC_MAXEVENTS];
+  cr_async_conn *conn;
+  long long now;
+  char drain[64];
+  int n, i, rc;
+
+  while (__atomic_load_n(&ah->running, __ATOMIC_ACQUIRE)) {
+    n = epoll_wait(ah->epfd, events, CR_ASYNC_MAXEVENTS, CR_ASYNC_TICK);
+
+    for (i = 0; i < n; i++) {
+      if ((conn = events[i].data.ptr) == NULL) {
+        while (read(ah->wakeup[0], drain, sizeof(drain)) > 0)
+          ;
+        continue;
+      }
+      if (conn->fd == -1)
+        continue;
+      if (conn->connecting) {
+        if ((rc = cr_async_connected(ah, conn)) != 0)
+          cr_async_fail(ah, conn, rc);
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        if ((rc = cr_async_read(ah, conn)) != 0)
+          cr_async_fail(ah, conn, rc);
+    }
+
+    now = cr_now();
+
+    for (i = 0; i < ah->nconns; i++) {
+      conn = &(ah->conns[i]);
+
+      if (conn->fd == -1) {
+        if (now >= conn->retry)
+          cr_async_open(ah, conn);
+        continue;
+      }
+      if (conn->connecting) {
+        if (now >= conn->retry)
+          cr_async_fail(ah, conn, CREDIS_ERR_CONNECT);
+        continue;
+      }
+
+      pthread_mutex_lock(&ah->mutex);
+      rc = cr_async_write(ah, conn);
+      if (rc == 0 && conn->head != NULL && conn->head->deadline < now)
+        rc = CREDIS_ERR_TIMEOUT;
+      pthread_mutex_unlock(&ah->mutex);
+
+      if (rc != 0)
+        cr_async_fail(ah, conn, rc == -1 ? CREDIS_ERR_SEND : rc);
+    }
+  }
+
+  for (i = 0; i < ah->nconns; i++)
+    cr_async_fail(ah, &(ah->conns[i]), CREDIS_ERR);
+
+  return NULL;
+}
+
+static void cr_async_delete(cr_async *ah)
+{
+  int i;
+
+  if (ah->conns != NULL) {
+    for (i = 0; i < ah->nconns; i++) {
+      free(ah->conns[i].out.data);
+      free(ah->conns[i].in.data);
+      free(ah->conns[i].elements.bulks);
+      free(ah->conns[i].elements.idxs);
+    }
+    free(ah->conns);
+  }
+  if (ah->epfd != -1)
+    close(ah->epfd);
+  if (ah->wakeup[0] != -1)
+    close(ah->wakeup[0]);
+  if (ah->wakeup[1] != -1)
+    close(ah->wakeup[1]);
+  pthread_mutex_destroy(&ah->mutex);
+  free(ah);
+}
+
+REDIS_ASYNC credis_async_connect(const char *host, int port, int timeout, int connections)
+{
+  struct epoll_event ev;
+  cr_async_conn *conn;
+  cr_async *ah;
+  int i;
+
+  if (connections < 1)
+    connections = 1;
+
+  if ((ah = calloc(sizeof(cr_async), 1)) == NULL)
+    return NULL;
+
+  ah->epfd = ah->wakeup[0] = ah->wakeup[1] = -1;
+  ah->timeout = timeout;
+  pthread_mutex_init(&ah->mutex, NULL);
+  ah->nconns = connections;
+
+  if (cr_resolve(host, port, &ah->sa) != 0 ||
+      (ah->conns = calloc(sizeof(cr_async_conn), connections)) == NULL)
+    goto error;
+
+  for (i = 0; i < connections; i++) {
+    ah->conns[i].fd = -1;
+    if ((ah->conns[i].out.data = malloc(CR_BUFFER_SIZE)) == NULL ||
+        (ah->conns[i].in.data = malloc(CR_BUFFER_SIZE)) == NULL ||
+        cr_morebulk(&ah->conns[i].elements, 0) != 0)
+      goto error;
+    ah->conns[i].out.size = ah->conns[i].in.size = CR_BUFFER_SIZE;
+  }
+
+  if ((ah->epfd = epoll_create(connections + 1)) == -1 ||
+      pipe(ah->wakeup) == -1 ||
+      fcntl(ah->wakeup[0], F_SETFL, O_NONBLOCK) == -1 ||
+      fcntl(ah->wakeup[1], F_SETFL, O_NONBLOCK) == -1)
+    goto error;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(ah->epfd, EPOLL_CTL_ADD, ah->wakeup[0], &ev) == -1)
+    goto error;
+
+  /* connect up front so a dead server is noticed by the caller, the I/O 
+   * thread isn't running yet */
+  for (i = 0; i < connections; i++)
+    cr_async_open(ah, &ah->conns[i]);
+
+  for (i = 0; i < connections; i++) {
+    conn = &(ah->conns[i]);
+    if (conn->connecting &&
+        (cr_poll(conn->fd, POLLOUT, conn->retry) <= 0 || cr_async_connected(ah, conn) != 0))
+      cr_async_fail(ah, conn, CREDIS_ERR_CONNECT);
+  }
+
+  for (i = 0; i < connections; i++)
+    if (ah->conns[i].fd != -1)
+      break;
+  if (i == connections)
+    goto error;
+
+  __atomic_store_n(&ah->running, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&ah->thread, NULL, cr_async_thread, ah) != 0)
+    goto error;
+
+  return ah;
+
+ error:
+  if (ah->conns != NULL)
+    for (i = 0; i < connections; i++)
+      if (ah->conns[i].fd != -1)
+        close(ah->conns[i].fd);
+  cr_async_delete(ah);
+  return NULL;
+}
+
+void credis_async_close(REDIS_ASYNC ah)
+{
+  __atomic_store_n(&ah->running, 0, __ATOMIC_RELEASE);
+  cr_async_wakeup(ah);
+  pthread_join(ah->thread, NULL);
+  cr_async_delete(ah);
+}
+
+int credis_async_command(REDIS_ASYNC ah, credis_async_cb cb, void *privdata, 
+                         int argc, const char **argv, const int *argvlen)
+{
+  cr_async_conn *conn = NULL;
+  cr_async_req *req;
+  int i, rc, len, wake;
+
+  if ((req = malloc(sizeof(cr_async_req))) == NULL)
+    return CREDIS_ERR_NOMEM;
+
+  req->cb = cb;
+  req->privdata = privdata;
+  req->deadline = cr_now() + ah->timeout;
+  req->next = NULL;
+
+  pthread_mutex_lock(&ah->mutex);
+
+  /* least loaded connection that is up */
+  for (i = 0; i < ah->nconns; i++)
+    if (ah->conns[i].fd != -1 && !ah->conns[i].connecting &&
+        (conn == NULL || ah->conns[i].inflight < conn->inflight))
+      conn = &(ah->conns[i]);
+
+  if (conn == NULL) {
+    pthread_mutex_unlock(&ah->mutex);
+    free(req);
+    return CREDIS_ERR_CONNECT;
+  }
+
+  len = conn->out.len;
+  if ((rc = cr_appendcount(&conn->out, argc)) != 0 ||
+      (rc = cr_appendargv(&conn->out, argc, argv, argvlen)) != 0) {
+    conn->out.len = len; /* drop partially appended command */
+    pthread_mutex_unlock(&ah->mutex);
+    free(req);
+    return rc;
+  }
+
+  if (conn->tail != NULL)
+    conn->tail->next = req;
+  else
+    conn->head = req;
+  conn->tail = req;
+  conn->inflight++;
+  ah->pending++;
+
+  /* the I/O thread only needs a nudge when output wasn't already pending */
+  wake = (len == 0);
+
+  pthread_mutex_unlock(&ah->mutex);
+
+  if (wake)
+    cr_async_wakeup(ah);
+
+  return 0;
+}
+
+int credis_async_pending(REDIS_ASYNC ah)
+{
+  int pending;
+
+  pthread_mutex_lock(&ah->mutex);
+  pending = ah->pending;
+  pthread_mutex_unlock(&ah->mutex);
+
+  return pending;
+}
+
+#endif /* CREDIS_ASYNC */
@@ -58,11 +58,13 @@ extern "C" {
  * independently. That means that one of two handles can be destroyed
  * while the other keeps its connection and data.
  * 
+ * Commands are sent using the multi-bulk request protocol (Redis >= 1.2),
+ * so keys and values may contain spaces and newlines.
+ *
  * TODO
  *  - Currently only support for zero-terminated strings, not for storing 
- *    abritary binary data as bulk data. Basically an API issue since it
- *    is partially supported internally.
- *  - Support for Redis >= 1.1 protocol
+ *    abritary binary data as bulk data, except through the pipelining API. 
+ *    Basically an API issue since it is supported internally.
  */
 
 /* handle to a Redis server connection */
@@ -77,6 +79,7 @@ typedef struct _cr_redis* REDIS;
 #define CREDIS_ERR_RECV -95
 #define CREDIS_ERR_TIMEOUT -96
 #define CREDIS_ERR_PROTOCOL -97
+#define CREDIS_ERR_NOSCRIPT -98
 
 #define CREDIS_TYPE_NONE 1
 #define CREDIS_TYPE_STRING 2
@@ -109,7 +112,8 @@ typedef struct _cr_info {
  */
 
 /* setting host to NULL will use "localhost". setting port to 0 will use 
- * default port 6379 */
+ * default port 6379. `timeout' is in milliseconds and limits connecting 
+ * as well as each command, from sending it until its reply is received */
 REDIS credis_connect(const char *host, int port, int timeout);
 
 void credis_close(REDIS rhnd);
@@ -120,6 +124,13 @@ int credis_auth(REDIS rhnd, const char *password);
 
 int credis_ping(REDIS rhnd);
 
+/* after a command returned CREDIS_ERR_PROTOCOL, returns the error reply 
+ * of the server, or NULL if the reply wasn't what was expected. Only after
+ * an error reply is the connection still in step with the server, after 
+ * any other failure part of a reply may be left unread and the connection
+ * should be closed */
+const char *credis_errorreply(REDIS rhnd);
+
 /* 
  * Commands operating on string values 
  */
@@ -147,6 +158,11 @@ int credis_decr(REDIS rhnd, const char *key, int *new_val);
 
 int credis_decrby(REDIS rhnd, const char *key, int decr_val, int *new_val);
 
+/* same as credis_incrby() and credis_decrby() for values that don't fit an int */
+int credis_incrby64(REDIS rhnd, const char *key, long long incr_val, long long *new_val);
+
+int credis_decrby64(REDIS rhnd, const char *key, long long decr_val, long long *new_val);
+
 /* returns -1 if the key doesn't exists and 0 if it does */
 int credis_exists(REDIS rhnd, const char *key);
 
@@ -320,6 +336,176 @@ int credis_monitor(REDIS rhnd);
 /* setting host to NULL and/or port to 0 will turn off replication */
 int credis_slaveof(REDIS rhnd, const char *host, int port);
 
+/*
+ * Scripting (Redis >= 2.6)
+ */
+
+/* returns -1 if no SHA1 digest was returned, else the digest of the 
+ * cached script is returned in `sha' */
+int credis_script_load(REDIS rhnd, const char *script, char **sha);
+
+/* Scripts must return a table of strings (a multi-bulk reply). Returns 
+ * number of values returned in vector `valv'. `keyc' is the number of keys
+ * stored in `keyv' and `argc' the number of arguments stored in `argv' */
+int credis_eval(REDIS rhnd, const char *script, int keyc, const char **keyv, 
+                int argc, const char **argv, char ***valv);
+
+/* same as credis_eval() but refers to a script cached by the server. 
+ * Returns CREDIS_ERR_NOSCRIPT if the server doesn't know the script */
+int credis_evalsha(REDIS rhnd, const char *sha, int keyc, const char **keyv, 
+                   int argc, const char **argv, char ***valv);
+
+/*
+ * Pipelining
+ *
+ * Commands are queued with credis_pipeline_append() and sent with a single 
+ * write by credis_pipeline_flush(). Replies must then be read in the order 
+ * the commands were queued, one credis_pipeline_read_*() call per command, 
+ * before the handle can be used for other commands:
+ *
+ *    const char *cmd1[] = {"DECRBY", "rn_alice", "100"};
+ *    const char *cmd2[] = {"DECRBY", "rn_bob", "200"};
+ *    credis_pipeline_begin(rh);
+ *    credis_pipeline_append(rh, 3, cmd1, NULL);
+ *    credis_pipeline_append(rh, 3, cmd2, NULL);
+ *    credis_pipeline_flush(rh);
+ *    credis_pipeline_read_int(rh, &alice);
+ *    credis_pipeline_read_int(rh, &bob);
+ *
+ * A failed read (other than an error reply from the server) means the 
+ * connection is out of sync and should be closed. Values returned by a 
+ * read are destroyed by the next read. 
+ */
+
+/* returns CREDIS_ERR if replies of a previous pipeline are still to be read */
+int credis_pipeline_begin(REDIS rhnd);
+
+/* `argc' is the number of arguments, including the command, in `argv'. 
+ * Arguments may hold any bytes if their lengths are given in `argvlen', 
+ * else `argvlen' may be NULL and arguments are zero-terminated strings */
+int credis_pipeline_append(REDIS rhnd, int argc, const char **argv, const int *argvlen);
+
+/* returns number of replies to read, or CREDIS_ERR_SEND/CREDIS_ERR_TIMEOUT
+ * if not all commands could be sent. The connection is then closed, since
+ * the server may have got part of them, and every later command on the 
+ * handle fails with CREDIS_ERR_SEND: it should be closed */
+int credis_pipeline_flush(REDIS rhnd);
+
+int credis_pipeline_read_int(REDIS rhnd, int *val);
+
+int credis_pipeline_read_int64(REDIS rhnd, long long *val);
+
+/* returns -1 if the key doesn't exists */
+int credis_pipeline_read_bulk(REDIS rhnd, char **val);
+
+int credis_pipeline_read_status(REDIS rhnd);
+
+/* returns number of values returned in vector `valv' */
+int credis_pipeline_read_multibulk(REDIS rhnd, char ***valv);
+
+/* returns number of replies not yet read */
+int credis_pipeline_pending(REDIS rhnd);
+
+/*
+ * Asynchronous client (Linux only, define CREDIS_NO_ASYNC to leave it out)
+ *
+ * A `REDIS_ASYNC' handle keeps a few non-blocking connections to a server
+ * and an I/O thread that sends commands and receives replies for all of 
+ * them using epoll. credis_async_command() only queues the command and 
+ * returns; its callback is later invoked from the I/O thread, exactly once,
+ * with the reply or an error. Many commands may be in flight at the same 
+ * time, they are spread over the connections and each connection pipelines
+ * the commands queued on it:
+ *
+ *    static void done(int rc, const REDIS_ASYNC_REPLY *reply, void *privdata)
+ *    {
+ *      if (rc == 0)
+ *        printf("%s is now %lld\n", (char *)privdata, reply->integer);
+ *    }
+ *
+ *    const char *cmd[] = {"DECRBY", "rn_alice", "100"};
+ *    REDIS_ASYNC ah = credis_async_connect("localhost", 6379, 2000, 2);
+ *    credis_async_command(ah, done, "alice", 3, cmd, NULL);
+ *
+ * Callbacks must not block since they hold up all other replies. Strings
+ * of a reply are only valid until the callback returns. Commands that get
+ * no reply within the handle timeout fail with CREDIS_ERR_TIMEOUT, along 
+ * with all other commands on the same connection, which is then 
+ * reconnected. Connections that go down are reconnected by the I/O thread.
+ */
+#if defined(__linux__) && !defined(CREDIS_NO_ASYNC)
+#define CREDIS_ASYNC 1
+#endif
+
+#ifdef CREDIS_ASYNC
+
+/* handle to a set of asynchronous Redis server connections */
+typedef struct _cr_async* REDIS_ASYNC;
+
+typedef struct _cr_async_reply {
+  char type;                    /* '+' status, '-' error, ':' integer, '$' bulk, '*' multi-bulk */
+  long long integer;            /* value of integer replies */
+  char *str;                    /* status, error, integer or bulk text, NULL for nil bulk */
+  int len;                      /* length of `str' */
+  int elements;                 /* number of multi-bulk elements */
+  char **element;               /* multi-bulk elements, NULL for nil elements */
+} REDIS_ASYNC_REPLY;
+
+/* `rc' is 0 on success, CREDIS_ERR_PROTOCOL for error replies, in which 
+ * case `reply' holds the error message, or another CREDIS_ERR_* code with 
+ * `reply' set to NULL */
+typedef void (*credis_async_cb)(int rc, const REDIS_ASYNC_REPLY *reply, void *privdata);
+
+/* `connections' is the number of connections to share between commands.
+ * Returns NULL unless at least one connection could be set up */
+REDIS_ASYNC credis_async_connect(const char *host, int port, int timeout, int connections);
+
+/* fails all commands still in flight with CREDIS_ERR */
+void credis_async_close(REDIS_ASYNC ah);
+
+/* arguments are as for credis_pipeline_append(). Returns CREDIS_ERR_CONNECT
+ * if no connection is currently up, in which case `cb' is not invoked */
+int credis_async_command(REDIS_ASYNC ah, credis_async_cb cb, void *privdata, 
+                         int argc, const char **argv, const int *argvlen);
+
+/* returns number of commands waiting for their reply */
+int credis_async_pending(REDIS_ASYNC ah);
+
+#endif /* CREDIS_ASYNC */
+
+/*
+ * Fault injection (define CREDIS_FAULTS to build it in)
+ *
+ * Makes the server look slow or unreliable, to see how an application 
+ * copes: replies are delayed by `latency_ms' plus up to `jitter_ms', and 
+ * `stall_permille' replies in a thousand are stalled for another 
+ * `stall_ms'. Connections are dropped, replies read in short pieces and 
+ * commands answered with an error reply at the given chances in a 
+ * thousand. Applies to every handle in the process, the asynchronous 
+ * client only sees delays, stalls, drops and short reads. Each thread 
+ * draws its chances from `seed' and the order in which threads first 
+ * inject a fault, so with the same seed and thread order a run repeats.
+ * Not meant for production use.
+ */
+#ifdef CREDIS_FAULTS
+
+typedef struct _cr_faults {
+  int latency_ms;
+  int jitter_ms;
+  int stall_permille;
+  int stall_ms;
+  int drop_permille;
+  int partial_permille;
+  int error_permille;
+  unsigned int seed;            /* 0 seeds from the clock */
+} REDIS_FAULTS;
+
+/* `faults' is copied, NULL turns fault injection off. Safe to call while
+ * other threads use credis */
+void credis_set_faults(const REDIS_FAULTS *faults);
+
+#endif /* CREDIS_FAULTS */
+
 #ifdef __cplusplus
 }
 #endif
@@ -41,23 +41,349 @@
 
 #include <switch.h>
 #include "credis.h"
+#ifndef WIN32
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+/* Money is counted in millionths of the account's currency, the way balances are kept in redis */
+typedef int64_t rednibble_money_t;
+
+#define RN_MONEY_SCALE INT64_C(1000000)
+
+/* Prints money with six decimals, exactly. Use as "Balance " RN_MONEY_FMT, RN_MONEY_ARGS(balance) */
+#define RN_MONEY_FMT "%s%" SWITCH_INT64_T_FMT ".%06" SWITCH_INT64_T_FMT
+#define RN_MONEY_ABS(m) ((m) < 0 ? -(m) : (m))
+#define RN_MONEY_ARGS(m) (m) < 0 ? "-" : "", RN_MONEY_ABS(m) / RN_MONEY_SCALE, RN_MONEY_ABS(m) % RN_MONEY_SCALE
+
+/* Build with -DRN_USDT for USDT probes (provider "rednibblebill") on the billing path, see also CREDIS_USDT in credis.c.
+   Needs <sys/sdt.h>, without it the probes compile to nothing */
+#ifdef RN_USDT
+#include <sys/sdt.h>
+#define RN_PROBE1(name, a) DTRACE_PROBE1(rednibblebill, name, a)
+#define RN_PROBE2(name, a, b) DTRACE_PROBE2(rednibblebill, name, a, b)
+#define RN_PROBE3(name, a, b, c) DTRACE_PROBE3(rednibblebill, name, a, b, c)
+#else
+#define RN_PROBE1(name, a)
+#define RN_PROBE2(name, a, b)
+#define RN_PROBE3(name, a, b, c)
+#endif
+
+/* Microseconds in a minute, rates are per minute */
+#define RN_MINUTE_US INT64_C(60000000)
 
 typedef struct {
 	switch_time_t lastts;		/* Last time we did any billing */
-	double total;				/* Total amount billed so far */
+	rednibble_money_t total;	/* Total amount billed so far */
 
 	switch_time_t pausets;		/* Timestamp of when a pause action started. 0 if not paused */
-	double bill_adjustments;	/* Adjustments to make to the next billing, based on pause/resume events */
+	rednibble_money_t bill_adjustments;	/* Adjustments to make to the next billing, based on pause/resume events */
 
 	int lowbal_action_executed;	/* Set to 1 once lowbal_action has been executed */
+
+	rednibble_money_t reserved;	/* Credit taken from the account for this call and not spent yet */
+	rednibble_money_t reserve_base;	/* Account balance when credit was last reserved, see charge_prepare() */
+
+	char *account;				/* Account whose rate this call adds to, see account_track() */
+	rednibble_money_t account_rate;	/* Rate it adds */
+
+	switch_mutex_t *mutex;		/* Protects this session's billing data. Never held while talking to redis */
 } rednibble_data_t;
 
+/* What the channel variables say about billing a session, parsed once. Never changed after profile_get() built it,
+   a new one replaces it when the variables change */
+typedef struct {
+	/* The variables it was built from */
+	const char *rate_var;
+	const char *increment_var;
+	const char *account_var;
+	const char *nobal_var;
+	const char *lowbal_var;
+	const char *percall_var;
+
+	rednibble_money_t rate;		/* Per minute */
+	switch_time_t increment;	/* Billing increment in microseconds, 0 bills by time elapsed */
+	rednibble_money_t nobal_amt;
+	rednibble_money_t lowbal_amt;
+	rednibble_money_t percall_max;
+	char *key;					/* rn_<account> */
+	const char *account;		/* Points into key */
+} rednibble_profile_t;
+
+
+typedef enum {
+	RN_BILLING_CLASSIC,			/* DECRBY from the module, thresholds checked by the module */
+	RN_BILLING_SCRIPT			/* One server-side script debits and checks thresholds atomically */
+} rednibble_billing_mode_t;
+
+/* Circuit breaker around redis, see breaker_allow() */
+typedef enum {
+	RN_BREAKER_CLOSED,			/* Redis is used */
+	RN_BREAKER_OPEN,			/* Redis calls fail straight away */
+	RN_BREAKER_HALF_OPEN		/* One caller is finding out whether redis is back */
+} rednibble_breaker_t;
+
+/* What calls are held to while redis can't tell an account's balance */
+typedef enum {
+	RN_DEGRADED_JOURNAL,		/* Nothing, calls go on unchecked */
+	RN_DEGRADED_ALLOW,			/* The last balance redis told us, less what the account was billed since */
+	RN_DEGRADED_DENY			/* New calls get nobal_action, calls in progress go on unchecked */
+} rednibble_degraded_t;
+
+/* What do_billing() has to do after a charge, as returned by the billing script */
+#define RN_ACTION_LOWBAL	(1 << 0)	/* Balance is at or below lowbal_amt */
+#define RN_ACTION_NOBAL		(1 << 1)	/* Balance is at or below nobal_amt */
+#define RN_ACTION_PERCALL	(1 << 2)	/* Call total is at or above percall_max_amt */
+
+/* KEYS[1] is the account, KEYS[2] the running total of this call.
+   ARGV is amount, nobal_amt, lowbal_amt, percall_max_amt (all in millionths, max of 0 means no limit) and the ttl of KEYS[2] */
+#define RN_BILLING_SCRIPT_SRC \
+	"local bal = redis.call('DECRBY', KEYS[1], ARGV[1])\n" \
+	"local total = redis.call('INCRBY', KEYS[2], ARGV[1])\n" \
+	"redis.call('EXPIRE', KEYS[2], ARGV[5])\n" \
+	"local action = 0\n" \
+	"if bal <= tonumber(ARGV[3]) then action = action + 1 end\n" \
+	"if bal <= tonumber(ARGV[2]) then action = action + 2 end\n" \
+	"if tonumber(ARGV[4]) > 0 and total >= tonumber(ARGV[4]) then action = action + 4 end\n" \
+	"return {tostring(action), tostring(bal), tostring(total)}\n"
+
+/* How long the per-call running total is kept in redis after the last charge */
+#define RN_CALL_TOTAL_TTL "86400"
+
+/* Replays a journaled debit once: KEYS[2] marks it as applied, ARGV[2] seconds long. Returns nil if it already was */
+#define RN_JOURNAL_SCRIPT_SRC \
+	"if redis.call('SET', KEYS[2], '1', 'NX', 'EX', ARGV[2]) then\n" \
+	"  return tostring(redis.call('DECRBY', KEYS[1], ARGV[1]))\n" \
+	"end\n" \
+	"return false\n"
+
+#define RN_JOURNAL_ID_TTL "604800"
+
+/* Balance of an account whose debit went to the journal instead of redis, or that redis couldn't be asked for */
+#define RN_BALANCE_UNKNOWN INT64_MIN
+
+/* A redis call that got no answer, error replies are answers */
+#define RN_REDIS_FAILED(rc) ((rc) == CREDIS_ERR_CONNECT || (rc) == CREDIS_ERR_SEND || (rc) == CREDIS_ERR_RECV || (rc) == CREDIS_ERR_TIMEOUT)
+
+/* A pooled redis connection. redis is NULL while the connection is down, it will be reopened on next checkout */
+typedef struct {
+	REDIS redis;
+	switch_time_t last_used;	/* Last time this connection was checked in, used for idle health checks */
+} rednibble_redis_conn_t;
+
+
+/* One trip to redis for a session: a debit of the time claimed since the last one, or just a balance lookup */
+typedef struct rednibble_charge {
+	char *uuid;
+	char *key;					/* rn_<account> */
+	const char *account;		/* Points into key */
+	rednibble_money_t rate;		/* Per minute */
+	rednibble_money_t amount;	/* Amount billed to the call */
+	rednibble_money_t debit_amount;	/* Amount to take from the account, differs from amount when reserving credit */
+	switch_time_t interval;		/* Call time amount pays for */
+	rednibble_money_t reserve;	/* Credit reserved by this charge on top of the bill */
+	switch_bool_t local;		/* Paid from the call's reserved credit, redis has nothing to do */
+	rednibble_money_t adjustments;	/* Pause adjustments taken off amount, cleared from the session once debited */
+	rednibble_money_t nobal_amt;
+	rednibble_money_t lowbal_amt;
+	rednibble_money_t percall_max;
+	switch_bool_t answered;		/* Unanswered calls are only checked against nobal_amt */
+	switch_bool_t debit;		/* SWITCH_FALSE to only look up the balance */
+
+	/* What redis made of it */
+	switch_bool_t ok;
+	rednibble_money_t balance;
+	int action;					/* RN_ACTION_* flags from the billing script, -1 if the module has to check the thresholds */
+	int resent;					/* Set once the billing script was sent again after NOSCRIPT */
+	switch_time_t sent;			/* When it went through the asynchronous client, for latency stats */
+	switch_bool_t probe;		/* Let through the half-open breaker to find out whether redis is back */
+
+	struct rednibble_charge *next;	/* Next charge in the same batch */
+} rednibble_charge_t;
+
+
+/* Heartbeat charges of one account collected during a billing window, sent to redis as one debit */
+typedef struct rednibble_batch {
+	char *key;					/* rn_<account> */
+	const char *account;		/* Points into key */
+	rednibble_money_t amount;	/* Sum of the debits */
+	int debits;					/* Number of charges that debit, the others only want the balance */
+	rednibble_charge_t *charges;
+	switch_bool_t ok;
+	rednibble_money_t balance;
+	struct rednibble_batch *next;
+} rednibble_batch_t;
+
+
+/* Billing timer wheel: three levels of 256 slots, at 100ms per tick the wheel reaches out about 19 days */
+#define RN_WHEEL_TICK_MS	100
+#define RN_WHEEL_BITS		8
+#define RN_WHEEL_SLOTS		(1 << RN_WHEEL_BITS)
+#define RN_WHEEL_MASK		(RN_WHEEL_SLOTS - 1)
+#define RN_WHEEL_LEVELS		3
+
+/* A billed session on the timer wheel */
+typedef struct rednibble_timer {
+	char uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+	uint64_t expires;			/* Tick this timer is due */
+	uint32_t interval;			/* Ticks between heartbeats */
+	struct rednibble_timer **slot;	/* Wheel slot this timer is on, NULL when it's not on the wheel */
+	struct rednibble_timer *prev;
+	struct rednibble_timer *next;
+} rednibble_timer_t;
+
+
+/* Calls being billed to one account, for adaptive heartbeats */
+typedef struct {
+	char *account;
+	rednibble_money_t rate;		/* Summed per minute rate of the calls */
+	int calls;
+} rednibble_account_t;
+
+
+/* Last balance redis told us for an account, for degraded_policy allow */
+typedef struct rednibble_balance {
+	char *key;
+	rednibble_money_t balance;
+	struct rednibble_balance *next;
+} rednibble_balance_t;
+
+
+/* A heartbeat waiting for a billing worker */
+typedef struct {
+	char *uuid;
+	switch_time_t queued;		/* When the heartbeat was queued, for latency stats */
+	rednibble_charge_t *charge;	/* Set when redis already answered and only the outcome is left to handle */
+} rednibble_job_t;
+
+
+/* Latency histogram, eight buckets per power of two of microseconds (about 12% resolution) up to days */
+#define RN_HIST_BUCKETS 320
+
+typedef struct {
+	uint64_t count[RN_HIST_BUCKETS];
+	uint64_t total;
+	switch_time_t sum;
+	switch_time_t max;
+} rednibble_hist_t;
+
+
+/* Debits journaled while redis is unreachable, kept in a ring in a memory mapped file until replayed. Records are
+   found again after a restart by walking from the head while the CRC and sequence numbers check out; older records
+   left behind in the ring have lower sequence numbers, a torn one a bad CRC. Native byte order */
+#define RN_JOURNAL_MAGIC "RNJRNL01"
+#define RN_JOURNAL_DATA 4096		/* Records start after the header page */
+#define RN_JOURNAL_WRAP 0xffffffff	/* Record length marking the rest of the file as unused, records go on at the start */
+#define RN_JOURNAL_BATCH 128		/* Most debits replayed in one pipeline */
+
+#define RN_LEDGER_BACKOFF_MS 100		/* First wait before a ledger batch redis didn't take is sent again */
+#define RN_LEDGER_BACKOFF_MAX_MS 5000	/* Doubling up to this */
+
+typedef struct {
+	char magic[8];
+	uint64_t instance;			/* Random, keeps the replay ids of different journal files apart */
+	uint64_t head;				/* Offset of the oldest debit redis hasn't got */
+	uint64_t head_seq;			/* Its sequence number */
+} rednibble_journal_hdr_t;
+
+typedef struct {
+	uint32_t len;				/* Of the whole record, a multiple of 8 */
+	uint32_t crc;				/* CRC-32 of the rest of the record */
+	uint64_t seq;
+	int64_t amount;
+	int64_t ts;
+	uint16_t keylen;			/* With the terminating zero. The key follows the record, then the uuid */
+	uint16_t uuidlen;
+	uint32_t pad;
+} rednibble_journal_rec_t;
+
+
+/* A charge on its way to the ledger stream, see ledger_add(). The strings are allocated along with it */
+typedef struct {
+	const char *kind;			/* "bill", "hangup" or "adjust" */
+	char *uuid;
+	char *account;
+	rednibble_money_t amount;
+	rednibble_money_t rate;
+	switch_time_t interval;
+	switch_time_t ts;
+} rednibble_ledger_entry_t;
+
+
+/* Latencies and counters kept for "rednibblebill stats", names in stats_latency_names and stats_counter_names */
+typedef enum {
+	RN_LAT_REDIS_CONNECT,
+	RN_LAT_REDIS_DECRBY,
+	RN_LAT_REDIS_GET,
+	RN_LAT_REDIS_SCRIPT,
+	RN_LAT_BILLING,				/* do_billing() from start to end */
+	RN_LAT_LOCK_WAIT,			/* Waiting for the global mutex to set up a session's billing */
+	RN_LAT_COUNT
+} rednibble_latency_t;
+
+typedef enum {
+	RN_STAT_HEARTBEATS,
+	RN_STAT_BILL_FAILURES,
+	RN_STAT_NOBAL_TRANSFERS,
+	RN_STAT_LOWBAL_ACTIONS,
+	RN_STAT_PERCALL_TRANSFERS,
+	RN_STAT_LEDGER_WRITTEN,
+	RN_STAT_LEDGER_DROPPED,		/* Buffer was full */
+	RN_STAT_LEDGER_FAILED,		/* Redis wouldn't take them, only logged */
+	RN_STAT_BREAKER_OPENED,
+	RN_STAT_BREAKER_REJECTED,	/* Redis calls failed straight away by the open breaker */
+	RN_STAT_DEGRADED_DENIED,	/* New calls sent to nobal_action by degraded_policy deny */
+	RN_STAT_COUNT
+} rednibble_counter_t;
+
+/* Stats are spread over shards picked by thread, and only ever changed with atomic adds, so billing threads
+   don't contend on a lock or on a cache line to keep them. Readers add the shards up */
+#define RN_STATS_SHARDS 16
+
+typedef struct {
+	rednibble_hist_t latency[RN_LAT_COUNT];
+	uint64_t counter[RN_STAT_COUNT];
+	char pad[64];				/* Keep the next shard's counters off this shard's last cache line */
+} rednibble_stats_t;
+
+
+/* Keys debited by "rednibblebill bench". Billing keys are rn_<account> and rnc_<uuid>, so no account name leads here
+   and the bench can't debit or delete a real account */
+#define RN_BENCH_KEY_FMT "rnbench:%d"
+
+/* A redis load test run by "rednibblebill bench", see bench_run() */
+typedef struct {
+	int calls;
+	int threads;
+	switch_time_t duration;
+	switch_time_t heartbeat;
+	switch_time_t skew;			/* Answer times are spread over this much */
+	switch_time_t increment;
+	rednibble_money_t rate;
+	switch_time_t start;
+} rednibble_bench_t;
+
+/* One bench thread and the simulated calls it bills */
+typedef struct {
+	rednibble_bench_t *bench;
+	int first;
+	int count;
+	rednibble_hist_t hist;
+	uint64_t heartbeats;
+	uint64_t commands;			/* DECRBYs sent, heartbeats reserved credit paid don't need one */
+	uint64_t failures;
+} rednibble_bench_worker_t;
+
 
 typedef struct rednibblebill_results {
-	double balance;
+	rednibble_money_t balance;
 
-	double percall_max;			/* Overrides global on a per-user level */
-	double lowbal_amt;			/*  ditto */
+	rednibble_money_t percall_max;	/* Overrides global on a per-user level */
+	rednibble_money_t lowbal_amt;	/*  ditto */
 } rednibblebill_results_t;
 
 
@@ -69,27 +395,143 @@ static struct {
 	/* Event hooks */
 	switch_event_node_t *node;
 
-	/* Global mutex (don't touch a session when it's already being touched) */
+	/* Global mutex, only held while setting up a session's billing data. The data itself is protected by its own mutex */
 	switch_mutex_t *mutex;
 
 	/* Global billing config options */
-	double percall_max_amt;		/* Per-call billing limit (safety check, for fraud) */
+	rednibble_money_t percall_max_amt;	/* Per-call billing limit (safety check, for fraud) */
 	char *percall_action;		/* Exceeded length of per-call action */
-	double lowbal_amt;			/* When we warn them they are near depletion */
+	rednibble_money_t lowbal_amt;	/* When we warn them they are near depletion */
 	char *lowbal_action;		/* Low balance action */
-	double nobal_amt;			/* Minimum amount that must remain in the account */
+	rednibble_money_t nobal_amt;	/* Minimum amount that must remain in the account */
 	char *nobal_action;			/* Drop action */
 
 	/* Other options */
 	int global_heartbeat;		/* Supervise and bill every X seconds, 0 means off */
+	switch_bool_t balance_deadlines;	/* Also bill when a call is due to cross lowbal_amt or nobal_amt */
+	switch_bool_t remember_unbilled;	/* Once a channel got to media without billing variables, leave it alone for good. Off by default */
+	switch_bool_t adaptive_heartbeat;	/* Derive the heartbeat from how long the account's balance lasts */
+	switch_time_t reserve_us;	/* Reserve credit for this much of a call at a time and bill it locally, 0 means off */
+	int heartbeat_min;			/* Bounds of the adaptive heartbeat, in seconds */
+	int heartbeat_max;
+
+	/* Accounts with calls being billed, only kept for adaptive heartbeats */
+	switch_mutex_t *accounts_mutex;
+	switch_hash_t *accounts;
+	rednibble_billing_mode_t billing_mode;
+	char billing_script_sha[41];	/* SHA1 of the billing script as cached by redis */
 
 	/* Database settings */
 	char *redis_host;
 	int redis_port;
 	int redis_timeout;
+	int redis_pool_size;		/* Number of long-lived connections kept open to redis */
+	int redis_idle_check;		/* Ping connections idle for longer than X seconds before handing them out, 0 means never */
+
+	/* Pool of idle redis connections */
+	switch_queue_t *redis_pool;
+	rednibble_redis_conn_t *redis_conns;
+
+	/* Heartbeats go through the asynchronous client when enabled, everything else uses the pool */
+	switch_bool_t redis_async_enabled;
+	int redis_async_connections;
+#ifdef CREDIS_ASYNC
+	REDIS_ASYNC redis_async;
+#endif
+#ifdef CREDIS_FAULTS
+	/* Faults injected into every redis reply, for testing only */
+	REDIS_FAULTS redis_faults;
+#endif
+
+	/* Billing workers, at least one: heartbeats are never billed on the timer wheel or event thread */
+	int billing_threads;
+	int billing_queue_size;
+	switch_queue_t *billing_queue;
+	switch_thread_t **billing_workers;
+	int running;
+
+	/* Billing timers, protected by wheel_mutex */
+	switch_mutex_t *wheel_mutex;
+	rednibble_timer_t *wheel[RN_WHEEL_LEVELS][RN_WHEEL_SLOTS];
+	uint64_t wheel_now;			/* Ticks since the wheel started */
+	switch_thread_t *wheel_thread;
+	int wheel_running;
+
+	/* Heartbeat charges waiting for the end of the billing window, by account */
+	int billing_window;			/* Length of the window in milliseconds, 0 sends every heartbeat on its own */
+	switch_mutex_t *batch_mutex;
+	switch_hash_t *batch_hash;
+	rednibble_batch_t *batches;
+	switch_thread_t *batch_thread;
+	int batch_running;
+
+	/* Billing worker stats, protected by stats_mutex */
+	switch_mutex_t *stats_mutex;
+	uint64_t jobs_done;
+	uint64_t jobs_dropped;
+	switch_time_t jobs_wait_total;	/* Time spent in the queue */
+	switch_time_t jobs_run_total;	/* Time spent billing */
+	switch_time_t jobs_run_max;
+	uint64_t batch_charges;		/* Heartbeat charges sent in a batch */
+	uint64_t batch_commands;	/* Redis commands those took */
+
+	/* Charges written behind to a redis stream, see ledger_add() */
+	char *ledger_stream;		/* Stream key, none means no ledger */
+	int ledger_maxlen;			/* Trim the stream to about this many entries, 0 means never */
+	int ledger_batch;			/* Most entries sent in one pipeline */
+	int ledger_queue_size;
+	int ledger_retry_ms;		/* How long a batch redis didn't take is retried before it's logged instead */
+	switch_queue_t *ledger_queue;
+	switch_thread_t *ledger_thread;
+	int ledger_running;
+
+	/* Debits waiting for redis, see journal_add(). Ring and sequence numbers are protected by journal_mutex */
+	char *journal_file;			/* None means failed debits are lost */
+	int journal_size;			/* In MB */
+	int journal_sync_ms;		/* How often the journal is written to disk */
+	int journal_fd;
+	char *journal_map;
+	uint64_t journal_map_size;
+	rednibble_journal_hdr_t *journal_hdr;
+	switch_mutex_t *journal_mutex;
+	uint64_t journal_tail;		/* Where the next record goes */
+	uint64_t journal_seq;		/* Its sequence number */
+	uint64_t journal_synced;	/* journal_seq when the journal was last written to disk */
+	int journal_pending;		/* Debits redis hasn't got yet */
+	switch_thread_t *journal_thread;
+	int journal_running;
+
+	/* Circuit breaker around redis, see breaker_allow(). Protected by breaker_mutex, the state is also read without it */
+	int breaker_failure_pct;	/* Share of redis calls in a window that have to fail to open the breaker, 0 means no breaker */
+	int breaker_min_calls;		/* A window with fewer calls never opens it */
+	int breaker_window_ms;
+	int breaker_open_ms;		/* How long it stays open before redis is tried again */
+	rednibble_degraded_t degraded_policy;
+	switch_mutex_t *breaker_mutex;
+	int breaker_state;			/* rednibble_breaker_t */
+	switch_time_t breaker_window_start;
+	int breaker_calls;
+	int breaker_failures;
+	switch_time_t breaker_retry;	/* When an open breaker lets a caller try redis */
+
+	/* Last known balances by account key, only kept with degraded_policy allow. Protected by balances_mutex */
+	switch_mutex_t *balances_mutex;
+	switch_hash_t *balances;
+	rednibble_balance_t *balance_list;
+
+	/* Latencies and counters, see stats_latency() */
+	rednibble_stats_t *stats;
+	switch_time_t stats_since;	/* Last reset, protected by stats_mutex */
 } globals;
 
 static void rednibblebill_pause(switch_core_session_t *session);
+static void billing_deadline_set(switch_core_session_t *session, switch_time_t when);
+static void billing_timer_schedule(switch_core_session_t *session, int seconds);
+static void stats_latency(rednibble_latency_t which, switch_time_t us);
+static void stats_add(rednibble_counter_t which, uint64_t n);
+static void stats_count(rednibble_counter_t which);
+static void ledger_add(const char *kind, const char *uuid, const char *account, rednibble_money_t amount, rednibble_money_t rate,
+					   switch_time_t interval);
 
 /**************************
 * Setup FreeSWITCH Macros *
@@ -108,6 +550,80 @@ SWITCH_DECLARE_GLOBAL_STRING_FUNC(set_global_redis_host, globals.redis_host);
 SWITCH_DECLARE_GLOBAL_STRING_FUNC(set_global_percall_action, globals.percall_action);
 SWITCH_DECLARE_GLOBAL_STRING_FUNC(set_global_lowbal_action, globals.lowbal_action);
 SWITCH_DECLARE_GLOBAL_STRING_FUNC(set_global_nobal_action, globals.nobal_action);
+SWITCH_DECLARE_GLOBAL_STRING_FUNC(set_global_ledger_stream, globals.ledger_stream);
+SWITCH_DECLARE_GLOBAL_STRING_FUNC(set_global_journal_file, globals.journal_file);
+
+/* Parse a decimal amount such as "-12.345" into money without going through floating point.
+   Digits past the sixth decimal round the last one */
+static rednibble_money_t money_parse(const char *str)
+{
+	rednibble_money_t whole = 0, frac = 0, scale = RN_MONEY_SCALE;
+	int neg = 0;
+
+	while (*str == ' ' || *str == '\t') {
+		str++;
+	}
+
+	if (*str == '-' || *str == '+') {
+		neg = *str++ == '-';
+	}
+
+	for (; *str >= '0' && *str <= '9'; str++) {
+		whole = whole * 10 + (*str - '0');
+	}
+
+	if (*str == '.') {
+		for (str++; *str >= '0' && *str <= '9' && scale > 1; str++) {
+			scale /= 10;
+			frac += (*str - '0') * scale;
+		}
+		frac += *str >= '5' && *str <= '9';
+	}
+
+	whole = whole * RN_MONEY_SCALE + frac;
+	return neg ? -whole : whole;
+}
+
+/* What us microseconds cost at rate per minute, rounded up to the next millionth. Whole minutes are split off
+   so rate * remainder stays well inside 64 bits */
+static inline rednibble_money_t money_for_time(rednibble_money_t rate, switch_time_t us)
+{
+	return rate * (us / RN_MINUTE_US) + (rate * (us % RN_MINUTE_US) + RN_MINUTE_US - 1) / RN_MINUTE_US;
+}
+
+/* Same, rounded down. For time given back, so rounding never favours the caller */
+static inline rednibble_money_t money_for_time_down(rednibble_money_t rate, switch_time_t us)
+{
+	return rate * (us / RN_MINUTE_US) + rate * (us % RN_MINUTE_US) / RN_MINUTE_US;
+}
+
+/* What elapsed microseconds of a call cost. With an increment that's whole increments, at least one, otherwise
+   just the time. The time paid for is returned in billed */
+static inline rednibble_money_t billing_period(rednibble_money_t rate, switch_time_t increment, switch_time_t elapsed, switch_time_t *billed)
+{
+	if (increment) {
+		switch_time_t units = (elapsed + increment - 1) / increment;
+		elapsed = (units + !units) * increment;
+	}
+
+	*billed = elapsed;
+	return money_for_time(rate, elapsed);
+}
+
+/* Pay amount out of the credit reserved for a call. Returns SWITCH_TRUE if enough is left, a quarter of a chunk
+   or more beyond amount (any, when chunk is 0). Otherwise what's left is used up and debit is set to the rest of
+   amount plus a new chunk, to take from the account */
+static switch_bool_t reservation_spend(rednibble_money_t *reserved, rednibble_money_t amount, rednibble_money_t chunk, rednibble_money_t *debit)
+{
+	if (*reserved >= amount && (!chunk || *reserved - amount >= chunk / 4)) {
+		*reserved -= amount;
+		return SWITCH_TRUE;
+	}
+
+	*debit = amount - *reserved + chunk;
+	*reserved = 0;
+	return SWITCH_FALSE;
+}
 
 static switch_status_t load_config(void)
 {
@@ -131,20 +647,108 @@ static switch_status_t load_config(void)
 				globals.redis_port = atoi(val);
 			} else if (!strcasecmp(var, "redis_timeout")) {
 				globals.redis_timeout = atoi(val);
+			} else if (!strcasecmp(var, "redis_pool_size")) {
+				globals.redis_pool_size = atoi(val);
+			} else if (!strcasecmp(var, "redis_idle_check")) {
+				globals.redis_idle_check = atoi(val);
+			} else if (!strcasecmp(var, "redis_async")) {
+				globals.redis_async_enabled = switch_true(val);
+			} else if (!strcasecmp(var, "redis_async_connections")) {
+				globals.redis_async_connections = atoi(val);
+			} else if (!strcasecmp(var, "billing_threads")) {
+				globals.billing_threads = atoi(val);
+			} else if (!strcasecmp(var, "billing_window")) {
+				globals.billing_window = atoi(val);
+			} else if (!strcasecmp(var, "billing_queue_size")) {
+				globals.billing_queue_size = atoi(val);
 			} else if (!strcasecmp(var, "percall_action")) {
 				set_global_percall_action(val);
 			} else if (!strcasecmp(var, "percall_max_amt")) {
-				globals.percall_max_amt = atof(val);
+				globals.percall_max_amt = money_parse(val);
 			} else if (!strcasecmp(var, "lowbal_action")) {
 				set_global_lowbal_action(val);
 			} else if (!strcasecmp(var, "lowbal_amt")) {
-				globals.lowbal_amt = atof(val);
+				globals.lowbal_amt = money_parse(val);
 			} else if (!strcasecmp(var, "nobal_action")) {
 				set_global_nobal_action(val);
 			} else if (!strcasecmp(var, "nobal_amt")) {
-				globals.nobal_amt = atof(val);
+				globals.nobal_amt = money_parse(val);
 			} else if (!strcasecmp(var, "global_heartbeat")) {
 				globals.global_heartbeat = atoi(val);
+			} else if (!strcasecmp(var, "balance_deadlines")) {
+				globals.balance_deadlines = switch_true(val);
+			} else if (!strcasecmp(var, "remember_unbilled")) {
+				globals.remember_unbilled = switch_true(val);
+			} else if (!strcasecmp(var, "reserve_minutes")) {
+				globals.reserve_us = (switch_time_t) (atof(val) * RN_MINUTE_US);
+			} else if (!strcasecmp(var, "adaptive_heartbeat")) {
+				globals.adaptive_heartbeat = switch_true(val);
+			} else if (!strcasecmp(var, "heartbeat_min")) {
+				globals.heartbeat_min = atoi(val);
+			} else if (!strcasecmp(var, "heartbeat_max")) {
+				globals.heartbeat_max = atoi(val);
+#ifdef CREDIS_FAULTS
+			} else if (!strcasecmp(var, "fault_latency_ms")) {
+				globals.redis_faults.latency_ms = atoi(val);
+			} else if (!strcasecmp(var, "fault_jitter_ms")) {
+				globals.redis_faults.jitter_ms = atoi(val);
+			} else if (!strcasecmp(var, "fault_stall_permille")) {
+				globals.redis_faults.stall_permille = atoi(val);
+			} else if (!strcasecmp(var, "fault_stall_ms")) {
+				globals.redis_faults.stall_ms = atoi(val);
+			} else if (!strcasecmp(var, "fault_drop_permille")) {
+				globals.redis_faults.drop_permille = atoi(val);
+			} else if (!strcasecmp(var, "fault_partial_permille")) {
+				globals.redis_faults.partial_permille = atoi(val);
+			} else if (!strcasecmp(var, "fault_error_permille")) {
+				globals.redis_faults.error_permille = atoi(val);
+			} else if (!strcasecmp(var, "fault_seed")) {
+				globals.redis_faults.seed = (unsigned int) strtoul(val, NULL, 10);
+#endif
+			} else if (!strcasecmp(var, "ledger_stream")) {
+				set_global_ledger_stream(val);
+			} else if (!strcasecmp(var, "ledger_maxlen")) {
+				globals.ledger_maxlen = atoi(val);
+			} else if (!strcasecmp(var, "ledger_batch")) {
+				globals.ledger_batch = atoi(val);
+			} else if (!strcasecmp(var, "ledger_queue_size")) {
+				globals.ledger_queue_size = atoi(val);
+			} else if (!strcasecmp(var, "ledger_retry_ms")) {
+				globals.ledger_retry_ms = atoi(val);
+			} else if (!strcasecmp(var, "journal_file")) {
+				set_global_journal_file(val);
+			} else if (!strcasecmp(var, "journal_size")) {
+				globals.journal_size = atoi(val);
+			} else if (!strcasecmp(var, "journal_sync_ms")) {
+				globals.journal_sync_ms = atoi(val);
+			} else if (!strcasecmp(var, "breaker_failure_pct")) {
+				globals.breaker_failure_pct = atoi(val);
+			} else if (!strcasecmp(var, "breaker_min_calls")) {
+				globals.breaker_min_calls = atoi(val);
+			} else if (!strcasecmp(var, "breaker_window_ms")) {
+				globals.breaker_window_ms = atoi(val);
+			} else if (!strcasecmp(var, "breaker_open_ms")) {
+				globals.breaker_open_ms = atoi(val);
+			} else if (!strcasecmp(var, "degraded_policy")) {
+				if (!strcasecmp(val, "allow")) {
+					globals.degraded_policy = RN_DEGRADED_ALLOW;
+				} else if (!strcasecmp(val, "deny")) {
+					globals.degraded_policy = RN_DEGRADED_DENY;
+				} else if (!strcasecmp(val, "journal")) {
+					globals.degraded_policy = RN_DEGRADED_JOURNAL;
+				} else {
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unknown degraded_policy %s, using journal\n", val);
+					globals.degraded_policy = RN_DEGRADED_JOURNAL;
+				}
+			} else if (!strcasecmp(var, "billing_mode")) {
+				if (!strcasecmp(val, "script")) {
+					globals.billing_mode = RN_BILLING_SCRIPT;
+				} else if (!strcasecmp(val, "classic")) {
+					globals.billing_mode = RN_BILLING_CLASSIC;
+				} else {
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unknown billing_mode %s, using classic\n", val);
+					globals.billing_mode = RN_BILLING_CLASSIC;
+				}
 			}
 		}
 	}
@@ -158,6 +762,54 @@ static switch_status_t load_config(void)
 	if (zstr(globals.nobal_action)) {
 		set_global_nobal_action("hangup");
 	}
+	if (globals.redis_pool_size < 1) {
+		globals.redis_pool_size = 8;
+	}
+	if (globals.heartbeat_min < 1) {
+		globals.heartbeat_min = 5;
+	}
+	if (globals.heartbeat_max < globals.heartbeat_min) {
+		globals.heartbeat_max = globals.heartbeat_min > 300 ? globals.heartbeat_min : 300;
+	}
+	if (globals.redis_async_connections < 1) {
+		globals.redis_async_connections = 2;
+	}
+	if (globals.billing_threads < 1) {
+		/* The timer wheel runs every call's heartbeats and balance deadlines, billing them on its own thread would hold
+		   them all up behind one slow redis reply. Lowbal/nobal actions mustn't run on the redis I/O and batch threads either */
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Heartbeats need billing workers, starting one\n");
+		globals.billing_threads = 1;
+	}
+	if (globals.billing_queue_size < 1) {
+		globals.billing_queue_size = 10000;
+	}
+	if (globals.ledger_batch < 1) {
+		globals.ledger_batch = 128;
+	}
+	if (globals.ledger_queue_size < 1) {
+		globals.ledger_queue_size = 10000;
+	}
+	if (globals.ledger_retry_ms < 1) {
+		globals.ledger_retry_ms = 60000;
+	}
+	if (globals.journal_size < 1) {
+		globals.journal_size = 64;
+	}
+	if (globals.journal_sync_ms < 1) {
+		globals.journal_sync_ms = 100;
+	}
+	if (globals.breaker_failure_pct < 0 || globals.breaker_failure_pct > 100) {
+		globals.breaker_failure_pct = 50;
+	}
+	if (globals.breaker_min_calls < 1) {
+		globals.breaker_min_calls = 1;
+	}
+	if (globals.breaker_window_ms < 1) {
+		globals.breaker_window_ms = 10000;
+	}
+	if (globals.breaker_open_ms < 1) {
+		globals.breaker_open_ms = 5000;
+	}
 
 	if (xml) {
 		switch_xml_free(xml);
@@ -167,7 +819,12 @@ static switch_status_t load_config(void)
 
 static switch_status_t redis_factory(REDIS *redis) 
 {
-	if (!((*redis) = credis_connect(globals.redis_host, globals.redis_port, globals.redis_timeout))) {
+	switch_time_t started = switch_micro_time_now();
+
+	*redis = credis_connect(globals.redis_host, globals.redis_port, globals.redis_timeout);
+	stats_latency(RN_LAT_REDIS_CONNECT, switch_micro_time_now() - started);
+
+	if (!*redis) {
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't connect to redis server at %s:%d timeout:%d\n", globals.redis_host, globals.redis_port, globals.redis_timeout);
 		return SWITCH_STATUS_FALSE;
 	} 
@@ -175,372 +832,3053 @@ static switch_status_t redis_factory(REDIS *redis)
 	return SWITCH_STATUS_SUCCESS;
 }
 
-void debug_event_handler(switch_event_t *event)
+/* Start failing redis calls straight away. Called with breaker_mutex held */
+static void breaker_open(switch_time_t now)
 {
-	if (!event) {
+	globals.breaker_retry = now + (switch_time_t) globals.breaker_open_ms * 1000;
+	__atomic_store_n(&globals.breaker_state, RN_BREAKER_OPEN, __ATOMIC_RELEASE);
+}
+
+static switch_bool_t breaker_closed(void)
+{
+	return __atomic_load_n(&globals.breaker_state, __ATOMIC_ACQUIRE) == RN_BREAKER_CLOSED;
+}
+
+/* Count a redis call towards the breaker's window. Once breaker_failure_pct of at least breaker_min_calls calls
+   in a window got no answer, the breaker opens */
+static void breaker_record(switch_bool_t failed)
+{
+	switch_time_t now;
+
+	if (!globals.breaker_failure_pct) {
 		return;
 	}
 
-	/* Print out all event headers, for fun */
-	if (event->headers) {
-		switch_event_header_t *event_header = NULL;
-		for (event_header = event->headers; event_header; event_header = event_header->next) {
-			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Header info: %s => %s\n", event_header->name, event_header->value);
+	now = switch_micro_time_now();
+	switch_mutex_lock(globals.breaker_mutex);
+
+	if (now - globals.breaker_window_start >= (switch_time_t) globals.breaker_window_ms * 1000) {
+		globals.breaker_window_start = now;
+		globals.breaker_calls = 0;
+		globals.breaker_failures = 0;
+	}
+
+	globals.breaker_calls++;
+	if (failed) {
+		globals.breaker_failures++;
+
+		if (globals.breaker_state == RN_BREAKER_CLOSED && globals.breaker_calls >= globals.breaker_min_calls &&
+			globals.breaker_failures * 100 >= globals.breaker_calls * globals.breaker_failure_pct) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "%d of the last %d redis calls failed, not calling redis for %d ms\n",
+							  globals.breaker_failures, globals.breaker_calls, globals.breaker_open_ms);
+			breaker_open(now);
+			stats_count(RN_STAT_BREAKER_OPENED);
 		}
 	}
+
+	switch_mutex_unlock(globals.breaker_mutex);
 }
 
-static switch_status_t exec_app(switch_core_session_t *session, const char *app_string)
+/* Whether redis may be called. While the breaker is open it may not, once breaker_open_ms is up the first caller
+   to ask is let through to find out if redis is back, and told so in probe. It has to report with breaker_probed() */
+static switch_bool_t breaker_allow(switch_bool_t *probe)
 {
-	switch_status_t status;
-	char *strings[2] = { 0 };
-	char *dup;
+	switch_bool_t allow = SWITCH_FALSE;
 
-	if (!app_string) {
-		return SWITCH_STATUS_FALSE;
+	*probe = SWITCH_FALSE;
+
+	if (breaker_closed()) {
+		return SWITCH_TRUE;
 	}
 
-	dup = strdup(app_string);
-	switch_assert(dup);
-	switch_separate_string(dup, ' ', strings, sizeof(strings) / sizeof(strings[0]));
-	status = switch_core_session_execute_application(session, strings[0], strings[1]);
-	free(dup);
-	return status;
+	switch_mutex_lock(globals.breaker_mutex);
+	if (globals.breaker_state == RN_BREAKER_CLOSED) {
+		allow = SWITCH_TRUE;
+	} else if (globals.breaker_state == RN_BREAKER_OPEN && switch_micro_time_now() >= globals.breaker_retry) {
+		__atomic_store_n(&globals.breaker_state, RN_BREAKER_HALF_OPEN, __ATOMIC_RELEASE);
+		allow = *probe = SWITCH_TRUE;
+	}
+	switch_mutex_unlock(globals.breaker_mutex);
+
+	if (!allow) {
+		stats_count(RN_STAT_BREAKER_REJECTED);
+	}
+
+	return allow;
 }
 
-static void transfer_call(switch_core_session_t *session, char *destination)
+/* How the call breaker_allow() let through to probe redis went. Redis is used again if it got an answer */
+static void breaker_probed(switch_bool_t failed)
 {
-	char *argv[4] = { 0 };
-	const char *uuid;
-	switch_channel_t *channel = switch_core_session_get_channel(session);
-	char *mydup;
+	switch_time_t now = switch_micro_time_now();
 
-	if (!destination) {
+	switch_mutex_lock(globals.breaker_mutex);
+	if (failed) {
+		breaker_open(now);
+	} else {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "Redis is answering again\n");
+		globals.breaker_window_start = now;
+		globals.breaker_calls = 0;
+		globals.breaker_failures = 0;
+		__atomic_store_n(&globals.breaker_state, RN_BREAKER_CLOSED, __ATOMIC_RELEASE);
+	}
+	switch_mutex_unlock(globals.breaker_mutex);
+}
+
+/* The call breaker_allow() let through to probe redis never got to it */
+static void breaker_unprobed(void)
+{
+	switch_mutex_lock(globals.breaker_mutex);
+	if (globals.breaker_state == RN_BREAKER_HALF_OPEN) {
+		__atomic_store_n(&globals.breaker_state, RN_BREAKER_OPEN, __ATOMIC_RELEASE);
+	}
+	switch_mutex_unlock(globals.breaker_mutex);
+}
+
+/* Open all pooled connections up front. Returns the number of connections that are up */
+static int redis_pool_init(void)
+{
+	int i, up = 0;
+
+	switch_queue_create(&globals.redis_pool, globals.redis_pool_size, globals.pool);
+	globals.redis_conns = switch_core_alloc(globals.pool, sizeof(rednibble_redis_conn_t) * globals.redis_pool_size);
+
+	for (i = 0; i < globals.redis_pool_size; i++) {
+		rednibble_redis_conn_t *conn = &globals.redis_conns[i];
+
+		/* A connection that fails here stays in the pool and is retried on checkout */
+		if (redis_factory(&conn->redis) == SWITCH_STATUS_SUCCESS) {
+			up++;
+		}
+		conn->last_used = switch_micro_time_now();
+		switch_queue_push(globals.redis_pool, conn);
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Opened %d of %d redis connections to %s:%d\n", up, globals.redis_pool_size,
+					  globals.redis_host, globals.redis_port);
+
+	return up;
+}
+
+static void redis_pool_destroy(void)
+{
+	void *pop = NULL;
+	int i;
+
+	if (!globals.redis_pool) {
 		return;
 	}
 
-	mydup = strdup(destination);
-	switch_assert(mydup);
-	switch_separate_string(mydup, ' ', argv, (sizeof(argv) / sizeof(argv[0])));
+	/* Wait for connections still checked out by billing in progress */
+	for (i = 0; i < globals.redis_pool_size; i++) {
+		if (switch_queue_pop_timeout(globals.redis_pool, &pop, 5000000) != SWITCH_STATUS_SUCCESS) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Gave up waiting for redis connections to be returned to the pool\n");
+			break;
+		}
+		if (((rednibble_redis_conn_t *) pop)->redis) {
+			credis_close(((rednibble_redis_conn_t *) pop)->redis);
+			((rednibble_redis_conn_t *) pop)->redis = NULL;
+		}
+	}
 
-	/* Find the uuid of our B leg. If it exists, transfer it first */
-	if ((uuid = switch_channel_get_partner_uuid(channel))) {
-		switch_core_session_t *b_session;
+	globals.redis_pool = NULL;
+}
 
-		/* Get info on the B leg */
-		if ((b_session = switch_core_session_locate(uuid))) {
-			/* Make sure we are in the media path on B leg */
-			switch_ivr_media(uuid, SMF_REBRIDGE);
+/* Borrow a connection from the pool. Blocks for at most redis_timeout if all connections are busy.
+   Returns NULL if no connection is available or it can't be (re)opened, and straight away while the breaker is open. */
+static rednibble_redis_conn_t *redis_checkout(void)
+{
+	rednibble_redis_conn_t *conn;
+	void *pop = NULL;
+	switch_bool_t probe;
 
-			/* Transfer the B leg */
-			switch_ivr_session_transfer(b_session, argv[0], argv[1], argv[2]);
-			switch_core_session_rwunlock(b_session);
+	if (!breaker_allow(&probe)) {
+		return NULL;
+	}
+
+	if (switch_queue_trypop(globals.redis_pool, &pop) != SWITCH_STATUS_SUCCESS &&
+		switch_queue_pop_timeout(globals.redis_pool, &pop, (switch_interval_time_t) globals.redis_timeout * 1000) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Timed out waiting for a free redis connection (pool size %d)\n", globals.redis_pool_size);
+		/* The pool being busy says nothing about redis, let the next caller probe */
+		if (probe) {
+			breaker_unprobed();
 		}
+		return NULL;
 	}
 
-	/* Make sure we are in the media path on A leg */
-	uuid = switch_core_session_get_uuid(session);
-	switch_ivr_media(uuid, SMF_REBRIDGE);
+	conn = (rednibble_redis_conn_t *) pop;
 
-	/* Transfer the A leg */
-	switch_ivr_session_transfer(session, argv[0], argv[1], argv[2]);
-	free(mydup);
+	/* Make sure a connection that sat idle wasn't dropped by the server in the meantime */
+	if (conn->redis && globals.redis_idle_check > 0 &&
+		switch_micro_time_now() - conn->last_used > (switch_time_t) globals.redis_idle_check * 1000000) {
+		if (credis_ping(conn->redis) != 0) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Idle redis connection failed health check, reconnecting\n");
+			credis_close(conn->redis);
+			conn->redis = NULL;
+		}
+	}
+
+	if (!conn->redis && redis_factory(&conn->redis) != SWITCH_STATUS_SUCCESS) {
+		conn->redis = NULL;
+	}
+
+	/* A ping tells whether redis is back before the callers the breaker held off go to it */
+	if (probe && conn->redis && credis_ping(conn->redis) != 0) {
+		credis_close(conn->redis);
+		conn->redis = NULL;
+	}
+
+	if (!conn->redis) {
+		switch_queue_push(globals.redis_pool, conn);
+		if (probe) {
+			breaker_probed(SWITCH_TRUE);
+		} else {
+			breaker_record(SWITCH_TRUE);
+		}
+		return NULL;
+	}
+
+	if (probe) {
+		breaker_probed(SWITCH_FALSE);
+	}
+
+	return conn;
 }
 
-/* At this time, billing never succeeds if you don't have a database. */
-static switch_status_t bill_event(double billamount, const char *billaccount, switch_channel_t *channel)
+/* Whether a connection is still in step with the server after a credis call on it returned rc. Error replies leave it so,
+   any other failure (a reply of the wrong type or one cut short included) may leave part of a reply to be read by the next command */
+static switch_bool_t redis_in_step(REDIS redis, int rc)
 {
-	REDIS redis;
-	char *rediskey;
-	int val;
-        int dec;
-        switch_status_t status = SWITCH_STATUS_FALSE;
+	if (rc == CREDIS_ERR_PROTOCOL) {
+		return credis_errorreply(redis) != NULL;
+	}
 
-	if (redis_factory(&redis) != SWITCH_STATUS_SUCCESS) {
-		return SWITCH_STATUS_FALSE;
+	return rc >= -1 || rc == CREDIS_ERR_NOSCRIPT;
+}
+
+/* Give a connection back to the pool. `rc' is the result of the last credis call made on it; a connection that
+   failed other than with an error reply may have a reply in flight, so it is closed and reopened on next checkout rather 
+   than reused. The failed command itself is not retried, a DECRBY may already have been applied by the server. */
+static void redis_checkin(rednibble_redis_conn_t *conn, int rc)
+{
+	switch_bool_t in_step = redis_in_step(conn->redis, rc);
+
+	/* Only redis failing to answer counts, not a local shortage */
+	breaker_record(RN_REDIS_FAILED(rc) || (rc == CREDIS_ERR_PROTOCOL && !in_step));
+
+	if (!in_step) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Dropping broken redis connection (error %d)\n", rc);
+		credis_close(conn->redis);
+		conn->redis = NULL;
 	}
 
-	rediskey = switch_mprintf("rn_%s", billaccount);
-	dec = (int)ceil(billamount*1000000);
-	
+	conn->last_used = switch_micro_time_now();
+	switch_queue_push(globals.redis_pool, conn);
+}
 
-	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Updating account %s by %e\n", billaccount, billamount);
-	
-	if (credis_decrby(redis, rediskey, dec, &val) != 0) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "ERR: Could not decrement redis value on key %s by %e\n", rediskey, billamount);
-		status = SWITCH_STATUS_FALSE;
-	} else {
-		status = SWITCH_STATUS_SUCCESS;
+#ifndef WIN32
+static uint32_t journal_crc_table[256];
+
+static uint32_t journal_crc(const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	uint32_t crc = 0xffffffff;
+
+	while (len--) {
+		crc = journal_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
 	}
 
-	credis_close(redis);
-	return status;
+	return crc ^ 0xffffffff;
+}
+
+/* The record at offset off if it is the one with sequence number seq, skipping a wrap to the start. Returns NULL at the end of the journal */
+static rednibble_journal_rec_t *journal_rec(uint64_t *off, uint64_t seq)
+{
+	rednibble_journal_rec_t *rec;
+
+	if (*off + sizeof(*rec) > globals.journal_map_size || *(uint32_t *) (globals.journal_map + *off) == RN_JOURNAL_WRAP) {
+		*off = RN_JOURNAL_DATA;
+	}
+
+	rec = (rednibble_journal_rec_t *) (globals.journal_map + *off);
+
+	if (rec->len < sizeof(*rec) || rec->len % 8 || *off + rec->len > globals.journal_map_size || rec->seq != seq ||
+		sizeof(*rec) + rec->keylen + rec->uuidlen > rec->len || rec->crc != journal_crc(&rec->seq, rec->len - 8)) {
+		return NULL;
+	}
+
+	return rec;
 }
 
+/* Debits in the journal that redis doesn't have yet. While there are any, new debits are journaled too, so they reach redis in order */
+static int journal_waiting(void)
+{
+	return globals.journal_map ? __atomic_load_n(&globals.journal_pending, __ATOMIC_RELAXED) : 0;
+}
 
-static double get_balance(const char *billaccount, switch_channel_t *channel)
+/* Append a debit of amount from key. Returns SWITCH_FALSE if there is no journal or it is full */
+static switch_bool_t journal_add(const char *key, rednibble_money_t amount, const char *uuid)
 {
-	REDIS redis;
-	char *rediskey;
-	char *str;
-	double val;
-	int result;
+	rednibble_journal_rec_t *rec;
+	size_t keylen = strlen(key) + 1, uuidlen = strlen(uuid ? uuid : "") + 1;
+	uint64_t len = (sizeof(*rec) + keylen + uuidlen + 7) & ~(uint64_t) 7, off, head;
+	switch_bool_t ok = SWITCH_FALSE;
+
+	if (!globals.journal_map || keylen > 0xffff || uuidlen > 0xffff) {
+		return SWITCH_FALSE;
+	}
+
+	switch_mutex_lock(globals.journal_mutex);
+
+	/* Always leave a gap between tail and head, the journal is empty when they meet */
+	off = globals.journal_tail;
+	head = globals.journal_hdr->head;
+	if (off >= head && off + len > globals.journal_map_size) {
+		if (off + sizeof(uint32_t) <= globals.journal_map_size) {
+			*(uint32_t *) (globals.journal_map + off) = RN_JOURNAL_WRAP;
+		}
+		off = RN_JOURNAL_DATA;
+	}
+
+	if ((off >= head && off + len <= globals.journal_map_size && (off != RN_JOURNAL_DATA || off + len < head || head == globals.journal_tail)) ||
+		(off < head && off + len < head)) {
+		rec = (rednibble_journal_rec_t *) (globals.journal_map + off);
+		memset(rec, 0, len);
+		rec->len = (uint32_t) len;
+		rec->seq = globals.journal_seq++;
+		rec->amount = amount;
+		rec->ts = switch_micro_time_now();
+		rec->keylen = (uint16_t) keylen;
+		rec->uuidlen = (uint16_t) uuidlen;
+		memcpy((char *) (rec + 1), key, keylen);
+		memcpy((char *) (rec + 1) + keylen, uuid ? uuid : "", uuidlen);
+		rec->crc = journal_crc(&rec->seq, len - 8);
+
+		globals.journal_tail = off + len;
+		__atomic_fetch_add(&globals.journal_pending, 1, __ATOMIC_RELAXED);
+		ok = SWITCH_TRUE;
+	}
+
+	switch_mutex_unlock(globals.journal_mutex);
+
+	if (!ok) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Billing journal %s is full, can't keep debit of " RN_MONEY_FMT " from %s!\n",
+						  globals.journal_file, RN_MONEY_ARGS(amount), key);
+	}
+
+	return ok;
+}
+
+/* Write the journal to disk if anything was added since last time */
+static void journal_sync(void)
+{
+	uint64_t seq;
+
+	switch_mutex_lock(globals.journal_mutex);
+	seq = globals.journal_seq;
+	switch_mutex_unlock(globals.journal_mutex);
+
+	if (seq != globals.journal_synced) {
+		msync(globals.journal_map, globals.journal_map_size, MS_SYNC);
+		globals.journal_synced = seq;
+	}
+}
+
+/* Send up to RN_JOURNAL_BATCH of the oldest journaled debits to redis in one pipeline, and drop the ones redis has from
+   the journal. Each goes with its own id, so a debit replayed again after a crash or a broken connection isn't taken twice.
+   Returns SWITCH_FALSE if redis couldn't be reached */
+static switch_bool_t journal_replay(void)
+{
+	rednibble_journal_rec_t *recs[RN_JOURNAL_BATCH];
+	uint64_t next[RN_JOURNAL_BATCH], off, seq;
+	char ids[RN_JOURNAL_BATCH][64], amount[32];
+	const char *argv[7];
+	rednibble_redis_conn_t *conn;
+	int count = 0, done = 0, rc = 0, i;
+
+	/* Records between head and tail stay where they are until the head moves past them, only this thread moves it */
+	switch_mutex_lock(globals.journal_mutex);
+	off = globals.journal_hdr->head;
+	seq = globals.journal_hdr->head_seq;
+	while (count < RN_JOURNAL_BATCH && seq != globals.journal_seq && (recs[count] = journal_rec(&off, seq))) {
+		switch_snprintf(ids[count], sizeof(ids[count]), "rnj_%" SWITCH_UINT64_T_FMT "_%" SWITCH_UINT64_T_FMT, globals.journal_hdr->instance, seq);
+		off += recs[count]->len;
+		next[count++] = off;
+		seq++;
+	}
+	switch_mutex_unlock(globals.journal_mutex);
+
+	if (!count || !(conn = redis_checkout())) {
+		return count == 0;
+	}
+
+	credis_pipeline_begin(conn->redis);
+	for (i = 0; i < count && rc == 0; i++) {
+		switch_snprintf(amount, sizeof(amount), "%" SWITCH_INT64_T_FMT, recs[i]->amount);
+		argv[0] = "EVAL";
+		argv[1] = RN_JOURNAL_SCRIPT_SRC;
+		argv[2] = "2";
+		argv[3] = (char *) (recs[i] + 1);
+		argv[4] = ids[i];
+		argv[5] = amount;
+		argv[6] = RN_JOURNAL_ID_TTL;
+		rc = credis_pipeline_append(conn->redis, 7, argv, NULL);
+	}
+
+	if (rc == 0 && (rc = credis_pipeline_flush(conn->redis)) > 0) {
+		rc = 0;
+	}
+
+	/* Replies come back in journal order, a debit only leaves the journal with all before it */
+	for (i = 0; i < count && rc == 0; i++) {
+		char *str;
+
+		rc = credis_pipeline_read_bulk(conn->redis, &str);
+		if (rc == -1) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Journaled debit %s was already applied\n", ids[i]);
+			rc = 0;
+		} else if (rc != 0 && redis_in_step(conn->redis, rc)) {
+			/* An error reply, replaying it again won't help */
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Redis refused journaled debit of " RN_MONEY_FMT " from %s (Call: %s)!\n",
+							  RN_MONEY_ARGS(recs[i]->amount), (char *) (recs[i] + 1), (char *) (recs[i] + 1) + recs[i]->keylen);
+			rc = 0;
+		}
+		if (rc == 0) {
+			done++;
+		}
+	}
+
+	redis_checkin(conn, credis_pipeline_pending(conn->redis) > 0 ? CREDIS_ERR_RECV : rc);
+
+	if (done) {
+		switch_mutex_lock(globals.journal_mutex);
+		if (globals.journal_hdr->head_seq + done == globals.journal_seq) {
+			/* Empty, start over at the beginning */
+			globals.journal_hdr->head = globals.journal_tail = RN_JOURNAL_DATA;
+		} else {
+			globals.journal_hdr->head = next[done - 1];
+		}
+		globals.journal_hdr->head_seq += done;
+		__atomic_fetch_sub(&globals.journal_pending, done, __ATOMIC_RELAXED);
+		switch_mutex_unlock(globals.journal_mutex);
+
+		msync(globals.journal_map, RN_JOURNAL_DATA, MS_SYNC);
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Replayed %d journaled debits, %d left\n", done, journal_waiting());
+	}
+
+	return done == count;
+}
+
+/* Writes the journal to disk every journal_sync_ms, and replays it while redis is reachable */
+static void *SWITCH_THREAD_FUNC journal_thread(switch_thread_t *thread, void *obj)
+{
+	switch_time_t retry = 0;
+
+	while (globals.journal_running) {
+		switch_yield(globals.journal_sync_ms * 1000);
+		journal_sync();
+
+		if (journal_waiting() && switch_micro_time_now() >= retry) {
+			while (journal_waiting() && globals.journal_running && journal_replay());
+			/* Don't keep a pooled connection busy reconnecting */
+			retry = journal_waiting() ? switch_micro_time_now() + 1000000 : 0;
+		}
+	}
+
+	/* Try once more, whatever is left is replayed after the next start */
+	while (journal_waiting() && journal_replay());
+	journal_sync();
+
+	return NULL;
+}
+
+/* Map the journal file at size bytes, growing or shrinking the file to that */
+static switch_bool_t journal_map(uint64_t size)
+{
+	if (ftruncate(globals.journal_fd, (off_t) size) < 0 ||
+		(globals.journal_map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, globals.journal_fd, 0)) == MAP_FAILED) {
+		globals.journal_map = NULL;
+		return SWITCH_FALSE;
+	}
+
+	globals.journal_map_size = size;
+	globals.journal_hdr = (rednibble_journal_hdr_t *) globals.journal_map;
+	return SWITCH_TRUE;
+}
+
+static void journal_open(void)
+{
+	switch_threadattr_t *thd_attr = NULL;
+	rednibble_journal_rec_t *rec;
+	struct stat st;
+	uint64_t off, size = (uint64_t) globals.journal_size * 1024 * 1024;
+	switch_bool_t script = globals.billing_mode == RN_BILLING_SCRIPT;
+	int i, j;
+
+	if (zstr(globals.journal_file)) {
+		return;
+	}
+
+	for (i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (j = 0; j < 8; j++) {
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		}
+		journal_crc_table[i] = c;
+	}
+
+	/* Script billing mode doesn't journal, it only looks for debits left from classic mode */
+	if ((globals.journal_fd = open(globals.journal_file, script ? O_RDWR : O_RDWR | O_CREAT, 0600)) < 0 && script && errno == ENOENT) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "journal_file is ignored in script billing mode\n");
+		return;
+	}
+
+	/* A journal from last time is read at the size it was written at, its ring would come apart at another size */
+	if (globals.journal_fd < 0 || fstat(globals.journal_fd, &st) < 0 ||
+		!journal_map(st.st_size > RN_JOURNAL_DATA ? (uint64_t) st.st_size : size)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't open billing journal %s: %s\n", globals.journal_file, strerror(errno));
+		if (globals.journal_fd >= 0) {
+			close(globals.journal_fd);
+		}
+		return;
+	}
+
+	if (memcmp(globals.journal_hdr->magic, RN_JOURNAL_MAGIC, 8) || globals.journal_hdr->head < RN_JOURNAL_DATA ||
+		globals.journal_hdr->head >= globals.journal_map_size) {
+		/* New file, or not ours */
+		memset(globals.journal_map, 0, RN_JOURNAL_DATA);
+		memcpy(globals.journal_hdr->magic, RN_JOURNAL_MAGIC, 8);
+		globals.journal_hdr->instance = ((uint64_t) switch_micro_time_now() << 16) ^ (uint64_t) getpid() ^ ((uint64_t) rand() << 32);
+		globals.journal_hdr->head = RN_JOURNAL_DATA;
+		globals.journal_hdr->head_seq = 1;
+		msync(globals.journal_map, RN_JOURNAL_DATA, MS_SYNC);
+	}
+
+	/* Find the tail of what is left from last time */
+	off = globals.journal_hdr->head;
+	globals.journal_seq = globals.journal_hdr->head_seq;
+	while ((rec = journal_rec(&off, globals.journal_seq))) {
+		off += rec->len;
+		globals.journal_seq++;
+		globals.journal_pending++;
+	}
+
+	if (script) {
+		/* Replaying a plain debit would skip the script's per-call total */
+		switch_log_printf(SWITCH_CHANNEL_LOG, globals.journal_pending ? SWITCH_LOG_CRIT : SWITCH_LOG_WARNING,
+						  "journal_file is ignored in script billing mode, %d debits in %s are not replayed until classic mode is used\n",
+						  globals.journal_pending, globals.journal_file);
+		munmap(globals.journal_map, globals.journal_map_size);
+		close(globals.journal_fd);
+		globals.journal_map = NULL;
+		globals.journal_pending = 0;
+		return;
+	}
+
+	if (globals.journal_map_size != size) {
+		if (globals.journal_pending) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Billing journal %s stays at %" SWITCH_UINT64_T_FMT " bytes rather than journal_size "
+							  "until its debits are replayed\n", globals.journal_file, globals.journal_map_size);
+		} else {
+			/* Nothing to keep, start the ring over at the new size */
+			munmap(globals.journal_map, globals.journal_map_size);
+			if (!journal_map(size)) {
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't resize billing journal %s: %s\n", globals.journal_file, strerror(errno));
+				close(globals.journal_fd);
+				return;
+			}
+			globals.journal_hdr->head = RN_JOURNAL_DATA;
+			msync(globals.journal_map, RN_JOURNAL_DATA, MS_SYNC);
+		}
+	}
+
+	globals.journal_tail = globals.journal_pending ? off : globals.journal_hdr->head;
+	globals.journal_synced = globals.journal_seq;
+
+	switch_mutex_init(&globals.journal_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+	globals.journal_running = 1;
+
+	switch_threadattr_create(&thd_attr, globals.pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+	switch_thread_create(&globals.journal_thread, thd_attr, journal_thread, NULL, globals.pool);
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, globals.journal_pending ? SWITCH_LOG_WARNING : SWITCH_LOG_INFO,
+					  "Billing journal %s opened with %d debits waiting for redis\n", globals.journal_file, globals.journal_pending);
+}
+
+/* Call once nothing bills anymore */
+static void journal_close(void)
+{
+	switch_status_t st;
+
+	if (!globals.journal_map) {
+		return;
+	}
+
+	globals.journal_running = 0;
+	switch_thread_join(&st, globals.journal_thread);
+	globals.journal_thread = NULL;
+
+	munmap(globals.journal_map, globals.journal_map_size);
+	close(globals.journal_fd);
+	globals.journal_map = NULL;
+}
+#else
+static int journal_waiting(void)
+{
+	return 0;
+}
+
+static switch_bool_t journal_add(const char *key, rednibble_money_t amount, const char *uuid)
+{
+	return SWITCH_FALSE;
+}
+
+static void journal_open(void)
+{
+	if (!zstr(globals.journal_file)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Billing journal not available on this platform\n");
+	}
+}
+
+static void journal_close(void)
+{
+}
+#endif
+
+/* Journal a charge's debit in place of sending it to redis. The balance is unknown until the journal is replayed */
+static switch_bool_t journal_charge(rednibble_charge_t *charge)
+{
+	if (!charge->debit || !journal_add(charge->key, charge->debit_amount, charge->uuid)) {
+		return SWITCH_FALSE;
+	}
+
+	charge->ok = SWITCH_TRUE;
+	charge->balance = RN_BALANCE_UNKNOWN;
+	return SWITCH_TRUE;
+}
+
+void debug_event_handler(switch_event_t *event)
+{
+	if (!event) {
+		return;
+	}
+
+	/* Print out all event headers, for fun */
+	if (event->headers) {
+		switch_event_header_t *event_header = NULL;
+		for (event_header = event->headers; event_header; event_header = event_header->next) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Header info: %s => %s\n", event_header->name, event_header->value);
+		}
+	}
+}
+
+/* switch_core_session_locate() for the billing path, which traces how long finding the session takes */
+static switch_core_session_t *billing_session_locate(const char *uuid)
+{
+	switch_core_session_t *session;
+
+	RN_PROBE1(locate__start, uuid);
+	session = switch_core_session_locate(uuid);
+	RN_PROBE2(locate__done, uuid, session != NULL);
+
+	return session;
+}
+
+static switch_status_t exec_app(switch_core_session_t *session, const char *app_string)
+{
+	switch_status_t status;
+	char *strings[2] = { 0 };
+	char *dup;
+
+	if (!app_string) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	dup = strdup(app_string);
+	switch_assert(dup);
+	switch_separate_string(dup, ' ', strings, sizeof(strings) / sizeof(strings[0]));
+	status = switch_core_session_execute_application(session, strings[0], strings[1]);
+	free(dup);
+	return status;
+}
+
+static void transfer_call(switch_core_session_t *session, char *destination)
+{
+	char *argv[4] = { 0 };
+	const char *uuid;
+	switch_channel_t *channel = switch_core_session_get_channel(session);
+	char *mydup;
+
+	if (!destination) {
+		return;
+	}
+
+	RN_PROBE2(transfer__start, switch_core_session_get_uuid(session), destination);
+
+	mydup = strdup(destination);
+	switch_assert(mydup);
+	switch_separate_string(mydup, ' ', argv, (sizeof(argv) / sizeof(argv[0])));
+
+	/* Find the uuid of our B leg. If it exists, transfer it first */
+	if ((uuid = switch_channel_get_partner_uuid(channel))) {
+		switch_core_session_t *b_session;
+
+		/* Get info on the B leg */
+		if ((b_session = switch_core_session_locate(uuid))) {
+			/* Make sure we are in the media path on B leg */
+			switch_ivr_media(uuid, SMF_REBRIDGE);
+
+			/* Transfer the B leg */
+			switch_ivr_session_transfer(b_session, argv[0], argv[1], argv[2]);
+			switch_core_session_rwunlock(b_session);
+		}
+	}
+
+	/* Make sure we are in the media path on A leg */
+	uuid = switch_core_session_get_uuid(session);
+	switch_ivr_media(uuid, SMF_REBRIDGE);
+
+	/* Transfer the A leg */
+	switch_ivr_session_transfer(session, argv[0], argv[1], argv[2]);
+	free(mydup);
+
+	RN_PROBE1(transfer__done, uuid);
+}
+
+/* Remember the balance redis told us for account key, to go by while it can't tell. Only with degraded_policy allow */
+static void balance_remember(const char *key, rednibble_money_t balance)
+{
+	rednibble_balance_t *known;
+
+	if (globals.degraded_policy != RN_DEGRADED_ALLOW || balance == RN_BALANCE_UNKNOWN) {
+		return;
+	}
+
+	switch_mutex_lock(globals.balances_mutex);
+	if (!(known = (rednibble_balance_t *) switch_core_hash_find(globals.balances, key))) {
+		switch_zmalloc(known, sizeof(*known));
+		known->key = strdup(key);
+		known->next = globals.balance_list;
+		globals.balance_list = known;
+		switch_core_hash_insert(globals.balances, known->key, known);
+	}
+	known->balance = balance;
+	switch_mutex_unlock(globals.balances_mutex);
+}
+
+/* What to hold account key to while redis can't tell its balance, once spent more has been billed to it.
+   RN_BALANCE_UNKNOWN means nothing, that's all there is unless degraded_policy is allow and redis told us the balance before */
+static rednibble_money_t balance_degraded(const char *key, rednibble_money_t spent)
+{
+	rednibble_balance_t *known;
+	rednibble_money_t balance = RN_BALANCE_UNKNOWN;
+
+	if (globals.degraded_policy != RN_DEGRADED_ALLOW) {
+		return RN_BALANCE_UNKNOWN;
+	}
+
+	switch_mutex_lock(globals.balances_mutex);
+	if ((known = (rednibble_balance_t *) switch_core_hash_find(globals.balances, key))) {
+		known->balance -= spent;
+		balance = known->balance;
+	}
+	switch_mutex_unlock(globals.balances_mutex);
+
+	return balance;
+}
+
+static void balances_destroy(void)
+{
+	rednibble_balance_t *known, *next;
+
+	switch_mutex_lock(globals.balances_mutex);
+	for (known = globals.balance_list; known; known = next) {
+		next = known->next;
+		switch_core_hash_delete(globals.balances, known->key);
+		free(known->key);
+		free(known);
+	}
+	globals.balance_list = NULL;
+	switch_mutex_unlock(globals.balances_mutex);
+}
+
+/* Without a database, billing only succeeds if the debit can be journaled. 
+   On success the account balance after the charge is returned in balance (if not NULL), RN_BALANCE_UNKNOWN if it was journaled */
+static switch_status_t bill_event(rednibble_money_t billamount, const char *rediskey, switch_channel_t *channel, rednibble_money_t *balance)
+{
+	rednibble_redis_conn_t *conn;
+	long long val;
+	int rc;
+	switch_time_t started;
+	switch_status_t status = SWITCH_STATUS_FALSE;
+
+	/* Only debits that certainly didn't reach redis are journaled, a timed out one may have been applied */
+	if ((journal_waiting() || !(conn = redis_checkout()))) {
+		if (!journal_add(rediskey, billamount, channel ? switch_channel_get_uuid(channel) : NULL)) {
+			return SWITCH_STATUS_FALSE;
+		}
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Journaled debit of " RN_MONEY_FMT " from %s\n", RN_MONEY_ARGS(billamount), rediskey);
+		if (balance) {
+			*balance = RN_BALANCE_UNKNOWN;
+		}
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Updating %s by " RN_MONEY_FMT "\n", rediskey, RN_MONEY_ARGS(billamount));
+	
+	started = switch_micro_time_now();
+	rc = credis_decrby64(conn->redis, rediskey, billamount, &val);
+	stats_latency(RN_LAT_REDIS_DECRBY, switch_micro_time_now() - started);
+
+	if (rc != 0) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "ERR: Could not decrement redis value on key %s by " RN_MONEY_FMT "\n", rediskey,
+						  RN_MONEY_ARGS(billamount));
+		status = SWITCH_STATUS_FALSE;
+	} else {
+		if (balance) {
+			*balance = val;
+		}
+		status = SWITCH_STATUS_SUCCESS;
+	}
+
+	redis_checkin(conn, rc);
+	return status;
+}
+
+
+/* Returns RN_BALANCE_UNKNOWN if redis can't be asked */
+static rednibble_money_t get_balance(const char *rediskey, switch_channel_t *channel)
+{
+	rednibble_redis_conn_t *conn;
+	char *str;
+	int result;
+	switch_time_t started;
+
+	rednibble_money_t balance = 0;
+
+	/* Redis was unreachable a moment ago, don't wait for it again */
+	if (journal_waiting() || !(conn = redis_checkout())) {
+		return RN_BALANCE_UNKNOWN;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Looking up redis key %s\n", rediskey);
+
+	started = switch_micro_time_now();
+	result = credis_get(conn->redis, (char *) rediskey, &str);
+	stats_latency(RN_LAT_REDIS_GET, switch_micro_time_now() - started);
+
+	if (result != 0) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "ERR: Could not get redis value on key %s (got result %d)\n", rediskey, result);
+		balance = RN_BALANCE_UNKNOWN;
+	} else {
+		balance = strtoll(str, NULL, 10);
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Key %s returned %s converted to " RN_MONEY_FMT "\n", rediskey, str, RN_MONEY_ARGS(balance));
+		balance_remember(rediskey, balance);
+	}
+
+	redis_checkin(conn, result);
+
+	return balance;
+}
+
+/* Cache the billing script in redis. Returns SWITCH_STATUS_FALSE if redis doesn't support scripting */
+static switch_status_t load_billing_script(void)
+{
+	rednibble_redis_conn_t *conn;
+	char *sha = NULL;
+	int rc;
+
+	if (!(conn = redis_checkout())) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if ((rc = credis_script_load(conn->redis, RN_BILLING_SCRIPT_SRC, &sha)) == 0 && sha) {
+		switch_copy_string(globals.billing_script_sha, sha, sizeof(globals.billing_script_sha));
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Loaded billing script as %s\n", globals.billing_script_sha);
+	} else {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't load billing script (got result %d), redis 2.6 or newer is required\n", rc);
+	}
+
+	redis_checkin(conn, rc);
+	return rc == 0 ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+}
+
+/* Charge billamount to billaccount and check the thresholds in one atomic script run.
+   On success the balance after the charge is returned in balance and the RN_ACTION_* flags in action */
+static switch_status_t bill_event_script(rednibble_money_t billamount, const char *rediskey, const char *uuid, rednibble_money_t nobal_amt,
+										 rednibble_money_t lowbal_amt, rednibble_money_t percall_max, rednibble_money_t *balance, int *action)
+{
+	rednibble_redis_conn_t *conn;
+	char *keyv[2];
+	char argbuf[4][32];
+	const char *argv[5];
+	char **valv = NULL;
+	int rc;
+	switch_time_t started;
+	switch_status_t status = SWITCH_STATUS_FALSE;
+
+	if (!(conn = redis_checkout())) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	keyv[0] = (char *) rediskey;
+	keyv[1] = switch_mprintf("rnc_%s", uuid);
+
+	switch_snprintf(argbuf[0], sizeof(argbuf[0]), "%" SWITCH_INT64_T_FMT, billamount);
+	switch_snprintf(argbuf[1], sizeof(argbuf[1]), "%" SWITCH_INT64_T_FMT, nobal_amt);
+	switch_snprintf(argbuf[2], sizeof(argbuf[2]), "%" SWITCH_INT64_T_FMT, lowbal_amt);
+	switch_snprintf(argbuf[3], sizeof(argbuf[3]), "%" SWITCH_INT64_T_FMT, percall_max);
+	argv[0] = argbuf[0];
+	argv[1] = argbuf[1];
+	argv[2] = argbuf[2];
+	argv[3] = argbuf[3];
+	argv[4] = RN_CALL_TOTAL_TTL;
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Updating %s by " RN_MONEY_FMT " (script)\n", rediskey, RN_MONEY_ARGS(billamount));
+
+	started = switch_micro_time_now();
+	rc = credis_evalsha(conn->redis, globals.billing_script_sha, 2, (const char **) keyv, 5, argv, &valv);
+
+	/* The script cache is flushed when redis restarts, send the whole script which caches it again */
+	if (rc == CREDIS_ERR_NOSCRIPT) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Billing script not cached by redis, sending it again\n");
+		rc = credis_eval(conn->redis, RN_BILLING_SCRIPT_SRC, 2, (const char **) keyv, 5, argv, &valv);
+	}
+	stats_latency(RN_LAT_REDIS_SCRIPT, switch_micro_time_now() - started);
+
+	if (rc == 3 && valv[0] && valv[1]) {
+		*action = atoi(valv[0]);
+		*balance = strtoll(valv[1], NULL, 10);
+		status = SWITCH_STATUS_SUCCESS;
+	} else {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "ERR: Billing script failed on key %s (got result %d)\n", keyv[0], rc);
+	}
+
+	switch_safe_free(keyv[1]);
+	redis_checkin(conn, rc);
+	return status;
+}
+
+static rednibble_charge_t *charge_create(const char *uuid, const rednibble_profile_t *profile)
+{
+	rednibble_charge_t *charge;
+
+	switch_zmalloc(charge, sizeof(*charge));
+	charge->uuid = strdup(uuid);
+	charge->key = strdup(profile->key);
+	charge->account = charge->key + (profile->account - profile->key);
+	charge->nobal_amt = profile->nobal_amt;
+	charge->action = -1;
+
+	return charge;
+}
+
+static void charge_destroy(rednibble_charge_t *charge)
+{
+	switch_safe_free(charge->uuid);
+	switch_safe_free(charge->key);
+	free(charge);
+}
+
+/* Set as the _rednibble_unbilled_ private of channels billing_settle() found not to be billed */
+static const char rednibble_unbilled = 1;
+
+static int profile_var_changed(const char *was, const char *is)
+{
+	return (was == NULL) != (is == NULL) || (was && strcmp(was, is));
+}
+
+/* The session's billing profile, rebuilt if any of the variables it was built from changed since.
+   Returns NULL if the session isn't billed */
+static const rednibble_profile_t *profile_get(switch_core_session_t *session)
+{
+	switch_channel_t *channel = switch_core_session_get_channel(session);
+	rednibble_profile_t *profile;
+	const char *billrate, *billincrement, *billaccount, *nobal, *lowbal, *percall;
+
+	/* Most channels aren't billed, don't go through their variables again and again */
+	if (switch_channel_get_private(channel, "_rednibble_unbilled_")) {
+		return NULL;
+	}
+
+	/* Return if there's no billing information on this session */
+	if (!(billrate = switch_channel_get_variable(channel, "rednibble_rate")) || !(billaccount = switch_channel_get_variable(channel, "rednibble_account"))) {
+		return NULL;
+	}
+
+	profile = (rednibble_profile_t *) switch_channel_get_private(channel, "_rednibble_profile_");
+	billincrement = switch_channel_get_variable(channel, "rednibble_increment");
+	nobal = switch_channel_get_variable(channel, "nobal_amt");
+	lowbal = switch_channel_get_variable(channel, "lowbal_amt");
+	percall = switch_channel_get_variable(channel, "percall_max_amt");
+
+	if (profile && !profile_var_changed(profile->rate_var, billrate) && !profile_var_changed(profile->increment_var, billincrement) &&
+		!profile_var_changed(profile->account_var, billaccount) && !profile_var_changed(profile->nobal_var, nobal) &&
+		!profile_var_changed(profile->lowbal_var, lowbal) && !profile_var_changed(profile->percall_var, percall)) {
+		return profile;
+	}
+
+	/* Heartbeats may still be using the old one, it goes away with the session */
+	profile = switch_core_session_alloc(session, sizeof(*profile));
+	profile->rate_var = switch_core_session_strdup(session, billrate);
+	profile->increment_var = billincrement ? switch_core_session_strdup(session, billincrement) : NULL;
+	profile->account_var = switch_core_session_strdup(session, billaccount);
+	profile->nobal_var = nobal ? switch_core_session_strdup(session, nobal) : NULL;
+	profile->lowbal_var = lowbal ? switch_core_session_strdup(session, lowbal) : NULL;
+	profile->percall_var = percall ? switch_core_session_strdup(session, percall) : NULL;
+
+	profile->rate = money_parse(billrate);
+	profile->increment = zstr(billincrement) || atol(billincrement) <= 0 ? 0 : (switch_time_t) atol(billincrement) * 1000000;
+	profile->nobal_amt = zstr(nobal) ? globals.nobal_amt : money_parse(nobal);
+	profile->lowbal_amt = zstr(lowbal) ? globals.lowbal_amt : money_parse(lowbal);
+	profile->percall_max = zstr(percall) ? globals.percall_max_amt : money_parse(percall);
+	profile->key = switch_core_session_sprintf(session, "rn_%s", billaccount);
+	profile->account = profile->key + 3;
+
+	switch_channel_set_private(channel, "_rednibble_profile_", profile);
+	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Billing profile: " RN_MONEY_FMT " per minute to account %s\n", RN_MONEY_ARGS(profile->rate),
+					  profile->account);
+
+	return profile;
+}
+
+/* Take the call's rate off the account it was counted towards. Called with accounts_mutex held */
+static void account_release(rednibble_data_t *rednibble_data)
+{
+	rednibble_account_t *acct;
+
+	if (rednibble_data->account && (acct = (rednibble_account_t *) switch_core_hash_find(globals.accounts, rednibble_data->account))) {
+		acct->rate -= rednibble_data->account_rate;
+		if (--acct->calls == 0) {
+			switch_core_hash_delete(globals.accounts, acct->account);
+			free(acct->account);
+			free(acct);
+		}
+	}
+
+	rednibble_data->account = NULL;
+	rednibble_data->account_rate = 0;
+}
+
+/* Count this call's rate towards its account. Called with the session's billing data locked, whenever the call is billed,
+   so a rate or account changed mid-call is picked up */
+static void account_track(switch_core_session_t *session, rednibble_data_t *rednibble_data, const char *account, rednibble_money_t rate)
+{
+	rednibble_account_t *acct;
+
+	if (rednibble_data->account && !strcmp(rednibble_data->account, account) && rednibble_data->account_rate == rate) {
+		return;
+	}
+
+	switch_mutex_lock(globals.accounts_mutex);
+
+	/* Take back what we added to the old account */
+	account_release(rednibble_data);
+
+	if (!(acct = (rednibble_account_t *) switch_core_hash_find(globals.accounts, account))) {
+		switch_zmalloc(acct, sizeof(*acct));
+		acct->account = strdup(account);
+		switch_core_hash_insert(globals.accounts, acct->account, acct);
+	}
+	acct->rate += rate;
+	acct->calls++;
+
+	switch_mutex_unlock(globals.accounts_mutex);
+
+	rednibble_data->account = switch_core_session_strdup(session, account);
+	rednibble_data->account_rate = rate;
+}
+
+/* The call stopped spending, take its rate off its account */
+static void account_untrack(switch_core_session_t *session)
+{
+	switch_channel_t *channel = switch_core_session_get_channel(session);
+	rednibble_data_t *rednibble_data;
+
+	if (!globals.adaptive_heartbeat || !(rednibble_data = (rednibble_data_t *) switch_channel_get_private(channel, "_rednibble_data_"))) {
+		return;
+	}
+
+	switch_mutex_lock(rednibble_data->mutex);
+	switch_mutex_lock(globals.accounts_mutex);
+	account_release(rednibble_data);
+
+	switch_mutex_unlock(globals.accounts_mutex);
+	switch_mutex_unlock(rednibble_data->mutex);
+}
+
+/* Returns the summed per minute rate of the calls billed to account */
+static rednibble_money_t account_rate(const char *account)
+{
+	rednibble_account_t *acct;
+	rednibble_money_t rate = 0;
+
+	switch_mutex_lock(globals.accounts_mutex);
+	if ((acct = (rednibble_account_t *) switch_core_hash_find(globals.accounts, account))) {
+		rate = acct->rate;
+	}
+	switch_mutex_unlock(globals.accounts_mutex);
+
+	return rate;
+}
+
+/* Claim what there is to bill on this session since the last charge. The claimed time is never billed again, 
+   whatever becomes of the charge. Returns NULL if there's nothing to ask redis about */
+static rednibble_charge_t *charge_prepare(switch_core_session_t *session)
+{
+	/* FS vars we will use */
+	switch_channel_t *channel;
+	switch_caller_profile_t *profile;
+
+	/* Local vars */
+	rednibble_data_t *rednibble_data;
+	rednibble_charge_t *charge = NULL;
+	switch_time_t ts = switch_micro_time_now();
+	rednibble_money_t billamount;
+	char date[80] = "";
+	char *uuid;
+	switch_size_t retsize;
+	switch_time_exp_t tm;
+	const rednibble_profile_t *billing;
+
+	if (!session) {
+		/* Why are we here? */
+		return NULL;
+	}
+
+	uuid = switch_core_session_get_uuid(session);
+
+	/* Get channel var */
+	if (!(channel = switch_core_session_get_channel(session))) {
+		return NULL;
+	}
+
+	/* Return if there's no billing information on this session */
+	if (!(billing = profile_get(session))) {
+		return NULL;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Attempting to bill at " RN_MONEY_FMT " per minute to account %s\n", RN_MONEY_ARGS(billing->rate),
+					  billing->account);
+
+	/* Get caller profile info from channel */
+	profile = switch_channel_get_caller_profile(channel);
+
+	if (!profile || !profile->times) {
+		/* No caller profile (why would this happen?) */
+		return NULL;
+	}
+
+	if (profile->times->answered < 1) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Not billing %s - call is not in answered state\n", billing->account);
+
+		/* See if this person has enough money left to continue the call */
+		return charge_create(uuid, billing);
+	}
+
+	/* Get our rednibble data var. This will be NULL if it's our first call here for this session */
+	rednibble_data = (rednibble_data_t *) switch_channel_get_private(channel, "_rednibble_data_");
+
+	/* Have we done any billing on this channel yet? If no, set up vars for doing so */
+	if (!rednibble_data) {
+		/* Make sure a heartbeat and a hangup don't both set it up */
+		switch_time_t waited = switch_micro_time_now();
+
+		RN_PROBE1(lock__wait, uuid);
+		switch_mutex_lock(globals.mutex);
+		stats_latency(RN_LAT_LOCK_WAIT, switch_micro_time_now() - waited);
+		RN_PROBE1(lock__acquire, uuid);
+
+		if (!(rednibble_data = (rednibble_data_t *) switch_channel_get_private(channel, "_rednibble_data_"))) {
+			rednibble_data = switch_core_session_alloc(session, sizeof(*rednibble_data));
+			memset(rednibble_data, 0, sizeof(*rednibble_data));
+			switch_mutex_init(&rednibble_data->mutex, SWITCH_MUTEX_NESTED, switch_core_session_get_pool(session));
+
+			/* Setup new billing data (based on call answer time, in case this module started late with active calls) */
+			rednibble_data->lastts = profile->times->answered;	/* Set the initial answer time to match when the call was really answered */
+			switch_channel_set_private(channel, "_rednibble_data_", rednibble_data);
+			switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Beginning new billing on %s\n", uuid);
+		}
+
+		switch_mutex_unlock(globals.mutex);
+		RN_PROBE1(lock__release, uuid);
+	}
+
+	/* Lock this session's data for this module while we tinker with it */
+	switch_mutex_lock(rednibble_data->mutex);
+
+	/* Are we in paused mode? If so, we don't do anything here - go back! */
+	if (rednibble_data->pausets > 0) {
+		switch_mutex_unlock(rednibble_data->mutex);
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Received heartbeat, but we're paused - ignoring\n");
+		return NULL;
+	}
+
+	charge = charge_create(uuid, billing);
+	charge->answered = SWITCH_TRUE;
+	charge->rate = billing->rate;
+
+	if (globals.adaptive_heartbeat) {
+		account_track(session, rednibble_data, billing->account, charge->rate);
+	}
+	charge->lowbal_amt = billing->lowbal_amt;
+	charge->percall_max = billing->percall_max;
+
+	switch_time_exp_lt(&tm, rednibble_data->lastts);
+	switch_strftime_nocheck(date, &retsize, sizeof(date), "%Y-%m-%d %T", &tm);
+
+	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "%d seconds passed since last bill time of %s\n",
+					  (int) ((ts - rednibble_data->lastts) / 1000000), date);
+
+	if ((ts - rednibble_data->lastts) >= 0) {
+		switch_time_t billed;
+
+		billamount = billing_period(billing->rate, billing->increment, ts - rednibble_data->lastts, &billed) - rednibble_data->bill_adjustments;
+		charge->interval = billed;
+		/* Update the last time we billed, with increments that accounts for the prepaid amount */
+		rednibble_data->lastts += billed;
+
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Billing " RN_MONEY_FMT " to %s (Call: %s / " RN_MONEY_FMT " so far)\n",
+						  RN_MONEY_ARGS(billamount), billing->account, uuid, RN_MONEY_ARGS(rednibble_data->total));
+
+		/* This billing period is ours now. Pause/resume may add adjustments while redis works on it, only the ones we billed
+		   are cleared once it's done */
+		charge->debit = SWITCH_TRUE;
+		charge->amount = billamount;
+		charge->debit_amount = billamount;
+		charge->adjustments = rednibble_data->bill_adjustments;
+
+		if (globals.reserve_us > 0) {
+			switch_channel_state_t state = switch_channel_get_state(channel);
+			/* No point reserving more for a call that's over */
+			rednibble_money_t chunk = state == CS_HANGUP || state == CS_REPORTING ? 0 : money_for_time(charge->rate, globals.reserve_us);
+
+			if (reservation_spend(&rednibble_data->reserved, billamount, chunk, &charge->debit_amount)) {
+				charge->local = SWITCH_TRUE;
+				charge->ok = SWITCH_TRUE;
+				charge->balance = rednibble_data->reserve_base + rednibble_data->reserved;
+			} else {
+				/* Should the new reservation fail charge_complete() puts the leftover back */
+				charge->reserve = chunk;
+			}
+		}
+	} else {
+		if (!billing->increment)
+			switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "Just tried to bill %s negative minutes! That should be impossible.\n", uuid);
+	}
+
+	/* Done changing - release lock */
+	switch_mutex_unlock(rednibble_data->mutex);
+
+	return charge;
+}
+
+/* Work out when this call, at its rate, takes the balance across the next threshold and bill it right then, 
+   rather than up to a whole heartbeat late. Other calls on the account only bring that moment closer, their own
+   bills catch it then. Each bill brings a fresh balance, so the deadline is worked out again after each one */
+static void billing_deadline_update(switch_core_session_t *session, rednibble_data_t *rednibble_data, rednibble_charge_t *charge, rednibble_money_t balance)
+{
+	rednibble_money_t threshold = charge->nobal_amt;
+	switch_time_t billed_to;
+	switch_time_t when = 0;
+
+	switch_mutex_lock(rednibble_data->mutex);
+	billed_to = rednibble_data->lastts;
+
+	/* Whichever threshold is crossed first */
+	if (!rednibble_data->lowbal_action_executed && charge->lowbal_amt > threshold && charge->lowbal_amt < balance) {
+		threshold = charge->lowbal_amt;
+	}
+
+	/* Paused calls don't spend anything */
+	if (charge->rate > 0 && !rednibble_data->pausets && balance > threshold) {
+		/* Whole minutes first, the same way money_for_time() keeps the products in range */
+		rednibble_money_t left = balance - threshold;
+		when = billed_to + left / charge->rate * RN_MINUTE_US + (left % charge->rate * RN_MINUTE_US + charge->rate - 1) / charge->rate;
+	}
+	switch_mutex_unlock(rednibble_data->mutex);
+
+	if (when) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Balance of " RN_MONEY_FMT " reaches " RN_MONEY_FMT " in %" SWITCH_INT64_T_FMT
+						  "ms (Account %s)\n", RN_MONEY_ARGS(balance), RN_MONEY_ARGS(threshold), (when - switch_micro_time_now()) / 1000, charge->account);
+	}
+
+	billing_deadline_set(session, when);
+}
+
+/* Heartbeat the call at half the time the account's balance lasts at the summed rate of its calls, within
+   heartbeat_min and heartbeat_max. Accounts with plenty of money are left alone, nearly empty ones are watched closely */
+static void billing_interval_update(switch_core_session_t *session, rednibble_charge_t *charge, rednibble_money_t balance)
+{
+	rednibble_money_t rate = account_rate(charge->account);
+	int64_t seconds = globals.heartbeat_max;
+
+	if (rate > 0 && (balance - charge->nobal_amt) * 30 / rate < seconds) {
+		seconds = (balance - charge->nobal_amt) * 30 / rate;
+	}
+	if (seconds < globals.heartbeat_min) {
+		seconds = globals.heartbeat_min;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Next heartbeat in %ds (Account %s at " RN_MONEY_FMT " per minute)\n",
+					  (int) seconds, charge->account, RN_MONEY_ARGS(rate));
+
+	billing_timer_schedule(session, (int) seconds);
+}
+
+/* Record what redis made of a charge and act on the balance. 
+   Returns SWITCH_STATUS_SUCCESS if the account balance is known, it is then stored in current_balance (if not NULL) */
+static switch_status_t charge_complete(switch_core_session_t *session, rednibble_charge_t *charge, rednibble_money_t *current_balance)
+{
+	switch_channel_t *channel = switch_core_session_get_channel(session);
+	rednibble_data_t *rednibble_data;
+	rednibble_money_t balance = charge->balance;
+	switch_bool_t have_balance = charge->ok && balance != RN_BALANCE_UNKNOWN;
+	int action = charge->action;
+	int run_lowbal = 0;
+
+	/* Keep the balance degraded_policy allow goes by up to date, by hand when the debit didn't get to redis */
+	if (have_balance && !charge->local) {
+		balance_remember(charge->key, balance);
+	} else if (charge->debit && !charge->local) {
+		balance_degraded(charge->key, charge->debit_amount);
+	}
+
+	if (!charge->answered) {
+		/* Redis couldn't tell, degraded_policy decides */
+		if (balance == RN_BALANCE_UNKNOWN) {
+			if (globals.degraded_policy == RN_DEGRADED_DENY) {
+				switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "Balance of account %s unknown, redis is unavailable. Denying the call\n",
+								  charge->account);
+				stats_count(RN_STAT_DEGRADED_DENIED);
+				RN_PROBE3(nobal, charge->uuid, charge->account, balance);
+				transfer_call(session, globals.nobal_action);
+				return SWITCH_STATUS_FALSE;
+			}
+			if ((balance = balance_degraded(charge->key, 0)) == RN_BALANCE_UNKNOWN) {
+				switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "Balance of account %s unknown, redis is unavailable. Allowing the call\n",
+								  charge->account);
+				return SWITCH_STATUS_FALSE;
+			}
+		}
+		if (current_balance) {
+			*current_balance = balance;
+		}
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Comparing " RN_MONEY_FMT " to hangup balance of " RN_MONEY_FMT "\n",
+						  RN_MONEY_ARGS(balance), RN_MONEY_ARGS(charge->nobal_amt));
+		if (balance <= charge->nobal_amt) {
+			/* Not enough money - reroute call to nobal location */
+			switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Balance of " RN_MONEY_FMT " fell below allowed amount of "
+							  RN_MONEY_FMT "! (Account %s)\n", RN_MONEY_ARGS(balance), RN_MONEY_ARGS(charge->nobal_amt), charge->account);
+
+			stats_count(RN_STAT_NOBAL_TRANSFERS);
+			RN_PROBE3(nobal, charge->uuid, charge->account, balance);
+			transfer_call(session, globals.nobal_action);
+		}
+
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	/* Set up by charge_prepare() */
+	rednibble_data = (rednibble_data_t *) switch_channel_get_private(channel, "_rednibble_data_");
+
+	/* A new reservation only gets what the account can cover above nobal_amt, the rest goes straight back */
+	if (charge->ok && charge->reserve > 0) {
+		rednibble_money_t granted = charge->reserve, after;
+
+		/* A journaled reservation is granted in full, redis is told about it later */
+		if (have_balance && balance < charge->nobal_amt) {
+			rednibble_money_t excess = charge->nobal_amt - balance < granted ? charge->nobal_amt - balance : granted;
+
+			if (bill_event(-excess, charge->key, channel, &after) == SWITCH_STATUS_SUCCESS) {
+				granted -= excess;
+				balance = after != RN_BALANCE_UNKNOWN ? after : balance + excess;
+			}
+		}
+
+		switch_mutex_lock(rednibble_data->mutex);
+		rednibble_data->reserved += granted;
+		if (have_balance) {
+			rednibble_data->reserve_base = balance;
+			balance += rednibble_data->reserved;
+		}
+		switch_mutex_unlock(rednibble_data->mutex);
+
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Reserved " RN_MONEY_FMT " of " RN_MONEY_FMT " for %s (Account %s)\n",
+						  RN_MONEY_ARGS(granted), RN_MONEY_ARGS(charge->reserve), charge->uuid, charge->account);
+	} else if (!charge->ok && charge->debit_amount != charge->amount) {
+		/* The credit this charge would have used up is still ours */
+		switch_mutex_lock(rednibble_data->mutex);
+		rednibble_data->reserved += charge->amount + charge->reserve - charge->debit_amount;
+		switch_mutex_unlock(rednibble_data->mutex);
+	}
+
+	if (charge->debit) {
+		const char *ledger_kind = NULL;
+
+		switch_mutex_lock(rednibble_data->mutex);
+
+		if (charge->ok) {
+			/* Increment total cost */
+			rednibble_data->total += charge->amount;
+
+			/* Reset manual billing adjustments from pausing */
+			rednibble_data->bill_adjustments -= charge->adjustments;
+
+			/* Update channel variable with current billing */
+			switch_channel_set_variable_printf(channel, "rednibble_total_billed", RN_MONEY_FMT, RN_MONEY_ARGS(rednibble_data->total));
+
+			ledger_kind = switch_channel_get_state(channel) == CS_HANGUP || switch_channel_get_state(channel) == CS_REPORTING ? "hangup" : "bill";
+		} else {
+			switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_CRIT, "Failed to log to database!\n");
+			stats_count(RN_STAT_BILL_FAILURES);
+		}
+
+		switch_mutex_unlock(rednibble_data->mutex);
+
+		/* Outside the lock, a hangup entry waits for room in the ledger buffer */
+		if (ledger_kind) {
+			ledger_add(ledger_kind, charge->uuid, charge->account, charge->amount, charge->rate, charge->interval);
+		}
+	}
+
+	/* don't verify balance and transfer to nobal if we're done with call */
+	if (switch_channel_get_state(channel) != CS_REPORTING && switch_channel_get_state(channel) != CS_HANGUP) {
+
+		/* Only go back to redis if the debit didn't already tell us the balance */
+		if (!have_balance) {
+			balance = get_balance(charge->key, channel);
+		}
+
+		/* Redis couldn't tell, go by the last balance it told us if degraded_policy allows */
+		if (balance == RN_BALANCE_UNKNOWN) {
+			balance = balance_degraded(charge->key, 0);
+		}
+		have_balance = balance != RN_BALANCE_UNKNOWN;
+
+		/* The billing script already compared against the thresholds, otherwise we do it here. Without a balance there's nothing to compare */
+		if (!have_balance) {
+			action = 0;
+		} else if (action < 0) {
+			action = 0;
+			if (balance <= charge->lowbal_amt) {
+				action |= RN_ACTION_LOWBAL;
+			}
+			if (balance <= charge->nobal_amt) {
+				action |= RN_ACTION_NOBAL;
+			}
+		}
+
+		/* See if we've achieved low balance. Claim the action first so concurrent billing doesn't run it twice */
+		if (action & RN_ACTION_LOWBAL) {
+			switch_mutex_lock(rednibble_data->mutex);
+			if (!rednibble_data->lowbal_action_executed) {
+				rednibble_data->lowbal_action_executed = 1;
+				run_lowbal = 1;
+			}
+			switch_mutex_unlock(rednibble_data->mutex);
+		}
+
+		if (run_lowbal) {
+			RN_PROBE3(lowbal, charge->uuid, charge->account, balance);
+			switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Balance of " RN_MONEY_FMT " fell below low balance amount of "
+							  RN_MONEY_FMT "! (Account %s)\n", RN_MONEY_ARGS(balance), RN_MONEY_ARGS(charge->lowbal_amt), charge->account);
+
+			if (exec_app(session, globals.lowbal_action) != SWITCH_STATUS_SUCCESS) {
+				switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Low balance action didn't execute\n");
+				switch_mutex_lock(rednibble_data->mutex);
+				rednibble_data->lowbal_action_executed = 0;
+				switch_mutex_unlock(rednibble_data->mutex);
+			} else {
+				stats_count(RN_STAT_LOWBAL_ACTIONS);
+			}
+		}
+
+		/* See if this call went over the per-call limit (only checked by the billing script) */
+		if ((action & RN_ACTION_PERCALL) && !(action & RN_ACTION_NOBAL)) {
+			switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_CRIT, "Call %s exceeded per-call maximum of " RN_MONEY_FMT "! (Account %s)\n",
+							  charge->uuid, RN_MONEY_ARGS(charge->percall_max), charge->account);
+
+			rednibblebill_pause(session);
+			stats_count(RN_STAT_PERCALL_TRANSFERS);
+			RN_PROBE3(percall, charge->uuid, charge->account, balance);
+			transfer_call(session, globals.percall_action);
+		}
+
+		/* See if this person has enough money left to continue the call */
+		if (action & RN_ACTION_NOBAL) {
+			/* Not enough money - reroute call to nobal location */
+			switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_CRIT, "Balance of " RN_MONEY_FMT " fell below allowed amount of "
+							  RN_MONEY_FMT "! (Account %s)\n", RN_MONEY_ARGS(balance), RN_MONEY_ARGS(charge->nobal_amt), charge->account);
+
+			/* IMPORTANT: Billing must be paused before the transfer occurs! This prevents infinite loops, since the transfer will result */
+			/* in rednibblebill checking the call again in the routing process for an allowed balance! */
+			/* If you intend to give the user the option to re-up their balance, you must clear & resume billing once the balance is updated! */
+			rednibblebill_pause(session);
+			stats_count(RN_STAT_NOBAL_TRANSFERS);
+			RN_PROBE3(nobal, charge->uuid, charge->account, balance);
+			transfer_call(session, globals.nobal_action);
+		} else if (have_balance) {
+			if (globals.balance_deadlines) {
+				billing_deadline_update(session, rednibble_data, charge, balance);
+			}
+			if (globals.adaptive_heartbeat) {
+				billing_interval_update(session, charge, balance);
+			}
+		}
+	}
+
+	if (!have_balance) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (current_balance) {
+		*current_balance = balance;
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* This is where we actually charge the guy 
+  This can be called anytime a call is in progress or at the end of a call before the session is destroyed 
+  Returns SWITCH_STATUS_SUCCESS if the account balance was learned along the way, it is then stored in current_balance (if not NULL) */
+static switch_status_t do_billing(switch_core_session_t *session, rednibble_money_t *current_balance)
+{
+	switch_channel_t *channel;
+	rednibble_charge_t *charge;
+	switch_status_t status;
+	switch_time_t started = switch_micro_time_now();
+
+	RN_PROBE1(billing__start, switch_core_session_get_uuid(session));
+
+	if (!(charge = charge_prepare(session))) {
+		RN_PROBE3(billing__done, switch_core_session_get_uuid(session), NULL, SWITCH_STATUS_FALSE);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	channel = switch_core_session_get_channel(session);
+
+	/* DO BILLING HERE and reset counters if it's successful! The debit hands us back the new balance */
+	if (charge->local) {
+		/* Paid from reserved credit */
+	} else if (!charge->debit) {
+		charge->balance = get_balance(charge->key, channel);
+		charge->ok = SWITCH_TRUE;
+	} else if (globals.billing_mode == RN_BILLING_SCRIPT) {
+		charge->ok = bill_event_script(charge->debit_amount, charge->key, charge->uuid, charge->nobal_amt, charge->lowbal_amt, charge->percall_max,
+									   &charge->balance, &charge->action) == SWITCH_STATUS_SUCCESS;
+	} else {
+		charge->ok = bill_event(charge->debit_amount, charge->key, channel, &charge->balance) == SWITCH_STATUS_SUCCESS;
+	}
+
+	status = charge_complete(session, charge, current_balance);
+	RN_PROBE3(billing__done, charge->uuid, charge->account, status);
+	charge_destroy(charge);
+
+	stats_latency(RN_LAT_BILLING, switch_micro_time_now() - started);
+
+	return status;
+}
+
+static void billing_job_destroy(rednibble_job_t *job)
+{
+	if (job->charge) {
+		charge_destroy(job->charge);
+	}
+	free(job->uuid);
+	free(job);
+}
+
+/* Bill a heartbeat, or handle the outcome of one that went through the asynchronous client */
+static void billing_job_run(rednibble_job_t *job)
+{
+	switch_core_session_t *session;
+	switch_time_t started, done;
+
+	started = switch_micro_time_now();
+
+	/* The call may have ended while the heartbeat was queued, hangup billing took care of it then */
+	if ((session = billing_session_locate(job->uuid))) {
+		if (job->charge) {
+			charge_complete(session, job->charge, NULL);
+		} else {
+			do_billing(session, NULL);
+		}
+		switch_core_session_rwunlock(session);
+	}
+
+	done = switch_micro_time_now();
+
+	switch_mutex_lock(globals.stats_mutex);
+	globals.jobs_done++;
+	globals.jobs_wait_total += started - job->queued;
+	globals.jobs_run_total += done - started;
+	if (done - started > globals.jobs_run_max) {
+		globals.jobs_run_max = done - started;
+	}
+	switch_mutex_unlock(globals.stats_mutex);
+
+	billing_job_destroy(job);
+}
+
+/* Hand a charge redis has answered to a billing worker, which acts on the balance.
+   Called from the event, batch and redis I/O threads, never from a billing worker, so waiting for room can't deadlock */
+static void charge_deliver(rednibble_charge_t *charge)
+{
+	rednibble_job_t *job;
+
+	switch_zmalloc(job, sizeof(*job));
+	job->uuid = strdup(charge->uuid);
+	job->queued = switch_micro_time_now();
+	job->charge = charge;
+
+	/* Rather hold up the caller than lose a charge redis already applied. Waiting for a worker rather than billing here
+	   keeps balance actions off the redis I/O thread, which would hold up the replies of every other call meanwhile */
+	if (globals.billing_queue &&
+		(switch_queue_trypush(globals.billing_queue, job) == SWITCH_STATUS_SUCCESS ||
+		 switch_queue_push(globals.billing_queue, job) == SWITCH_STATUS_SUCCESS)) {
+		return;
+	}
+
+	/* No workers, or they are stopping */
+	billing_job_run(job);
+}
+
+#ifdef CREDIS_ASYNC
+static void charge_done(int rc, const REDIS_ASYNC_REPLY *reply, void *privdata);
+
+/* Send a charge through the asynchronous client, charge_done() gets the reply. 
+   full_script sends the billing script itself rather than its SHA1 */
+static switch_status_t charge_submit(rednibble_charge_t *charge, switch_bool_t full_script)
+{
+	char *keyv[2] = { 0 };
+	char argbuf[4][32];
+	const char *argv[10];
+	int argc;
+	int rc;
+
+	keyv[0] = charge->key;
+
+	if (!charge->debit) {
+		argv[0] = "GET";
+		argv[1] = keyv[0];
+		argc = 2;
+	} else if (globals.billing_mode == RN_BILLING_SCRIPT) {
+		keyv[1] = switch_mprintf("rnc_%s", charge->uuid);
+		switch_snprintf(argbuf[0], sizeof(argbuf[0]), "%" SWITCH_INT64_T_FMT, charge->debit_amount);
+		switch_snprintf(argbuf[1], sizeof(argbuf[1]), "%" SWITCH_INT64_T_FMT, charge->nobal_amt);
+		switch_snprintf(argbuf[2], sizeof(argbuf[2]), "%" SWITCH_INT64_T_FMT, charge->lowbal_amt);
+		switch_snprintf(argbuf[3], sizeof(argbuf[3]), "%" SWITCH_INT64_T_FMT, charge->percall_max);
+		argv[0] = full_script ? "EVAL" : "EVALSHA";
+		argv[1] = full_script ? RN_BILLING_SCRIPT_SRC : globals.billing_script_sha;
+		argv[2] = "2";
+		argv[3] = keyv[0];
+		argv[4] = keyv[1];
+		argv[5] = argbuf[0];
+		argv[6] = argbuf[1];
+		argv[7] = argbuf[2];
+		argv[8] = argbuf[3];
+		argv[9] = RN_CALL_TOTAL_TTL;
+		argc = 10;
+	} else {
+		switch_snprintf(argbuf[0], sizeof(argbuf[0]), "%" SWITCH_INT64_T_FMT, charge->debit_amount);
+		argv[0] = "DECRBY";
+		argv[1] = keyv[0];
+		argv[2] = argbuf[0];
+		argc = 3;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Sending %s for account %s (" RN_MONEY_FMT ")\n", argv[0], charge->account,
+					  RN_MONEY_ARGS(charge->debit_amount));
+
+	charge->sent = switch_micro_time_now();
+
+	if ((rc = credis_async_command(globals.redis_async, charge_done, charge, argc, argv, NULL)) != 0) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "ERR: Could not send %s on key %s (got result %d)\n", argv[0], keyv[0], rc);
+	}
+
+	switch_safe_free(keyv[1]);
+
+	return rc == 0 ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+}
+
+/* Called from the redis I/O thread once a charge has its reply. Acting on the balance may run dialplan applications,
+   so that is left to a billing worker and this returns quickly */
+static void charge_done(int rc, const REDIS_ASYNC_REPLY *reply, void *privdata)
+{
+	rednibble_charge_t *charge = (rednibble_charge_t *) privdata;
+
+	/* The script cache is flushed when redis restarts, send the whole script which caches it again */
+	if (rc == CREDIS_ERR_PROTOCOL && reply && reply->str && !strncmp(reply->str, "NOSCRIPT", 8) && !charge->resent) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Billing script not cached by redis, sending it again\n");
+		charge->resent = 1;
+		if (charge_submit(charge, SWITCH_TRUE) == SWITCH_STATUS_SUCCESS) {
+			return;
+		}
+	}
+
+	if (charge->probe) {
+		breaker_probed(RN_REDIS_FAILED(rc));
+		charge->probe = SWITCH_FALSE;
+	} else if (charge->sent) {
+		breaker_record(RN_REDIS_FAILED(rc));
+	}
+
+	/* Never sent, so it can be journaled */
+	if (rc == CREDIS_ERR_CONNECT && journal_charge(charge)) {
+		charge_deliver(charge);
+		return;
+	}
+
+	if (charge->sent) {
+		stats_latency(!charge->debit ? RN_LAT_REDIS_GET : globals.billing_mode == RN_BILLING_SCRIPT ? RN_LAT_REDIS_SCRIPT : RN_LAT_REDIS_DECRBY,
+					  switch_micro_time_now() - charge->sent);
+	}
+
+	if (!charge->debit) {
+		if (rc == 0 && reply->str) {
+			charge->balance = strtoll(reply->str, NULL, 10);
+		} else {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "ERR: Could not get balance of %s (got result %d)\n", charge->account, rc);
+			charge->balance = RN_BALANCE_UNKNOWN;
+		}
+		charge->ok = SWITCH_TRUE;
+	} else if (globals.billing_mode == RN_BILLING_SCRIPT) {
+		if (rc == 0 && reply->elements == 3 && reply->element[0] && reply->element[1]) {
+			charge->action = atoi(reply->element[0]);
+			charge->balance = strtoll(reply->element[1], NULL, 10);
+			charge->ok = SWITCH_TRUE;
+		} else {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "ERR: Billing script failed for account %s (got result %d)\n", charge->account, rc);
+		}
+	} else {
+		if (rc == 0 && reply->type == ':') {
+			charge->balance = reply->integer;
+			charge->ok = SWITCH_TRUE;
+		} else {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "ERR: Could not decrement balance of %s by " RN_MONEY_FMT " (got result %d)\n",
+							  charge->account, RN_MONEY_ARGS(charge->debit_amount), rc);
+		}
+	}
+
+	charge_deliver(charge);
+}
+#endif
+
+/* Queue a heartbeat charge for the account's batch of the current billing window */
+static void batch_add(rednibble_charge_t *charge)
+{
+	rednibble_batch_t *batch;
+
+	switch_mutex_lock(globals.batch_mutex);
+
+	if (!(batch = (rednibble_batch_t *) switch_core_hash_find(globals.batch_hash, charge->account))) {
+		switch_zmalloc(batch, sizeof(*batch));
+		batch->key = strdup(charge->key);
+		batch->account = batch->key + (charge->account - charge->key);
+		batch->next = globals.batches;
+		globals.batches = batch;
+		switch_core_hash_insert(globals.batch_hash, batch->account, batch);
+	}
+
+	if (charge->debit) {
+		batch->amount += charge->debit_amount;
+		batch->debits++;
+	}
+	charge->next = batch->charges;
+	batch->charges = charge;
+
+	switch_mutex_unlock(globals.batch_mutex);
+}
+
+/* Send one DECRBY per account for all charges collected in the window (a GET for accounts with only unanswered calls),
+   pipelined on one connection, and hand every charge its account's new balance */
+static void batch_flush(void)
+{
+	rednibble_batch_t *batches, *batch, *next;
+	rednibble_charge_t *charge, *cnext;
+	rednibble_redis_conn_t *conn;
+	const char *argv[3];
+	char amount[32];
+	uint64_t charges = 0, commands = 0;
+	int rc = 0;
+
+	switch_mutex_lock(globals.batch_mutex);
+	batches = globals.batches;
+	globals.batches = NULL;
+	for (batch = batches; batch; batch = batch->next) {
+		switch_core_hash_delete(globals.batch_hash, batch->account);
+	}
+	switch_mutex_unlock(globals.batch_mutex);
+
+	if (!batches) {
+		return;
+	}
+
+	/* Journal the debits while redis is unreachable, balances are looked up once it is back */
+	if (journal_waiting() || !(conn = redis_checkout())) {
+		for (batch = batches; batch; batch = batch->next) {
+			if (batch->debits && journal_add(batch->key, batch->amount, NULL)) {
+				batch->balance = RN_BALANCE_UNKNOWN;
+				batch->ok = SWITCH_TRUE;
+			}
+		}
+	} else {
+		credis_pipeline_begin(conn->redis);
+
+		for (batch = batches; batch; batch = batch->next) {
+			if (batch->debits) {
+				switch_snprintf(amount, sizeof(amount), "%" SWITCH_INT64_T_FMT, batch->amount);
+				argv[0] = "DECRBY";
+				argv[1] = batch->key;
+				argv[2] = amount;
+				rc = credis_pipeline_append(conn->redis, 3, argv, NULL);
+			} else {
+				argv[0] = "GET";
+				argv[1] = batch->key;
+				rc = credis_pipeline_append(conn->redis, 2, argv, NULL);
+			}
+			if (rc != 0) {
+				break;
+			}
+			commands++;
+		}
+
+		if (rc == 0 && (rc = credis_pipeline_flush(conn->redis)) > 0) {
+			rc = 0;
+		}
+
+		/* Replies come back in the order the commands were appended */
+		for (batch = batches; batch && rc == 0; batch = batch->next) {
+			long long val;
+			char *str;
+
+			if (batch->debits) {
+				if ((rc = credis_pipeline_read_int64(conn->redis, &val)) == 0) {
+					batch->balance = val;
+					batch->ok = SWITCH_TRUE;
+				} else {
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "ERR: Could not decrement redis value on key %s by %" SWITCH_INT64_T_FMT " (got result %d)\n",
+									  batch->key, batch->amount, rc);
+				}
+			} else {
+				if ((rc = credis_pipeline_read_bulk(conn->redis, &str)) == 0) {
+					batch->balance = strtoll(str, NULL, 10);
+				} else {
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "ERR: Could not get redis value on key %s (got result %d)\n", batch->key, rc);
+					batch->balance = RN_BALANCE_UNKNOWN;
+				}
+				batch->ok = SWITCH_TRUE;
+			}
+
+			/* An error reply only fails this account, anything else leaves the connection out of sync */
+			if (rc != 0 && redis_in_step(conn->redis, rc)) {
+				rc = 0;
+			}
+		}
+
+		/* Replies left unread mean the connection is out of sync */
+		redis_checkin(conn, credis_pipeline_pending(conn->redis) > 0 ? CREDIS_ERR_RECV : rc);
+	}
+
+	for (batch = batches; batch; batch = next) {
+		next = batch->next;
+
+		if (!batch->ok) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "ERR: Billing window for account %s failed\n", batch->account);
+		}
+
+		for (charge = batch->charges; charge; charge = cnext) {
+			cnext = charge->next;
+			charge->next = NULL;
+			charge->ok = batch->ok;
+			charge->balance = batch->balance;
+			charges++;
+			charge_deliver(charge);
+		}
+
+		free(batch->key);
+		free(batch);
+	}
+
+	switch_mutex_lock(globals.stats_mutex);
+	globals.batch_charges += charges;
+	globals.batch_commands += commands;
+	switch_mutex_unlock(globals.stats_mutex);
+}
+
+static void *SWITCH_THREAD_FUNC batch_thread(switch_thread_t *thread, void *obj)
+{
+	while (globals.batch_running) {
+		switch_yield(globals.billing_window * 1000);
+		batch_flush();
+	}
+
+	/* Whatever came in since is billed too, the time was claimed from the calls already */
+	batch_flush();
+
+	return NULL;
+}
+
+static void batch_start(void)
+{
+	switch_threadattr_t *thd_attr = NULL;
+
+	if (globals.billing_window < 1) {
+		return;
+	}
+
+	if (globals.billing_mode == RN_BILLING_SCRIPT) {
+		/* The script keeps a running total per call, which a combined debit can't */
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "billing_window is ignored in script billing mode\n");
+		globals.billing_window = 0;
+		return;
+	}
+
+	switch_mutex_init(&globals.batch_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+	switch_core_hash_init(&globals.batch_hash, globals.pool);
+	globals.batch_running = 1;
+
+	switch_threadattr_create(&thd_attr, globals.pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+	switch_thread_create(&globals.batch_thread, thd_attr, batch_thread, NULL, globals.pool);
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Combining heartbeat debits per account every %dms\n", globals.billing_window);
+}
+
+static void batch_stop(void)
+{
+	switch_status_t st;
+
+	if (!globals.batch_thread) {
+		return;
+	}
+
+	globals.batch_running = 0;
+	switch_thread_join(&st, globals.batch_thread);
+	globals.batch_thread = NULL;
+
+	switch_core_hash_destroy(&globals.batch_hash);
+}
+
+/* Log an entry with all its fields, so a charge that never made it to the stream can still be reconciled from the logs */
+static void ledger_log(switch_log_level_t level, const char *what, rednibble_ledger_entry_t *entry)
+{
+	switch_log_printf(SWITCH_CHANNEL_LOG, level, "%s: %s uuid=%s account=%s amount=%" SWITCH_INT64_T_FMT " rate=%" SWITCH_INT64_T_FMT
+					  " interval_us=%" SWITCH_INT64_T_FMT " ts=%" SWITCH_INT64_T_FMT "\n", what, entry->kind, entry->uuid, entry->account, entry->amount,
+					  entry->rate, entry->interval, entry->ts);
+}
+
+/* Write a charge behind to the ledger stream. Heartbeat charges are dropped when the buffer is full, the others wait
+   for room: a call's last charge and adjustments always make it to the ledger thread */
+static void ledger_add(const char *kind, const char *uuid, const char *account, rednibble_money_t amount, rednibble_money_t rate,
+					   switch_time_t interval)
+{
+	rednibble_ledger_entry_t *entry;
+	size_t ulen, alen;
+
+	if (!globals.ledger_queue) {
+		return;
+	}
+
+	ulen = strlen(uuid) + 1;
+	alen = strlen(account) + 1;
+	switch_zmalloc(entry, sizeof(*entry) + ulen + alen);
+	entry->kind = kind;
+	entry->uuid = (char *) (entry + 1);
+	entry->account = entry->uuid + ulen;
+	memcpy(entry->uuid, uuid, ulen);
+	memcpy(entry->account, account, alen);
+	entry->amount = amount;
+	entry->rate = rate;
+	entry->interval = interval;
+	entry->ts = switch_micro_time_now();
+
+	if (switch_queue_trypush(globals.ledger_queue, entry) == SWITCH_STATUS_SUCCESS) {
+		return;
+	}
+
+	if (!strcmp(kind, "bill")) {
+		ledger_log(SWITCH_LOG_WARNING, "Ledger buffer full, not recording", entry);
+		stats_count(RN_STAT_LEDGER_DROPPED);
+		free(entry);
+		return;
+	}
+
+	switch_queue_push(globals.ledger_queue, entry);
+}
+
+/* Log an entry redis didn't take, after giving up on retrying it */
+static void ledger_lost(rednibble_ledger_entry_t *entry)
+{
+	ledger_log(SWITCH_LOG_ERROR, "Ledger entry not written", entry);
+	stats_count(RN_STAT_LEDGER_FAILED);
+}
+
+/* XADD entries to the ledger stream in one pipeline, fields as redis keeps balances (millionths and microseconds).
+   Returns how many entries from the first redis is done with: written, or refused and logged. The rest are to be sent
+   again, redis may have taken some of them before the connection broke so the stream can then hold an entry twice */
+static int ledger_write(rednibble_ledger_entry_t **entries, int count)
+{
+	rednibble_redis_conn_t *conn;
+	char maxlen[32], amount[32], rate[32], interval[32], ts[32];
+	const char *argv[19];
+	int argc, rc = CREDIS_ERR_CONNECT, i, done = 0, sent = 0;
+
+	if ((conn = redis_checkout())) {
+		credis_pipeline_begin(conn->redis);
+		switch_snprintf(maxlen, sizeof(maxlen), "%d", globals.ledger_maxlen);
+
+		for (i = 0; i < count; i++) {
+			rednibble_ledger_entry_t *entry = entries[i];
+
+			switch_snprintf(amount, sizeof(amount), "%" SWITCH_INT64_T_FMT, entry->amount);
+			switch_snprintf(rate, sizeof(rate), "%" SWITCH_INT64_T_FMT, entry->rate);
+			switch_snprintf(interval, sizeof(interval), "%" SWITCH_INT64_T_FMT, entry->interval);
+			switch_snprintf(ts, sizeof(ts), "%" SWITCH_INT64_T_FMT, entry->ts);
+
+			argc = 0;
+			argv[argc++] = "XADD";
+			argv[argc++] = globals.ledger_stream;
+			if (globals.ledger_maxlen > 0) {
+				argv[argc++] = "MAXLEN";
+				argv[argc++] = "~";
+				argv[argc++] = maxlen;
+			}
+			argv[argc++] = "*";
+			argv[argc++] = "kind";
+			argv[argc++] = entry->kind;
+			argv[argc++] = "uuid";
+			argv[argc++] = entry->uuid;
+			argv[argc++] = "account";
+			argv[argc++] = entry->account;
+			argv[argc++] = "amount";
+			argv[argc++] = amount;
+			argv[argc++] = "rate";
+			argv[argc++] = rate;
+			argv[argc++] = "interval_us";
+			argv[argc++] = interval;
+			argv[argc++] = "ts";
+			argv[argc++] = ts;
+
+			if ((rc = credis_pipeline_append(conn->redis, argc, argv, NULL)) != 0) {
+				break;
+			}
+		}
+
+		if (rc == 0 && (rc = credis_pipeline_flush(conn->redis)) > 0) {
+			rc = 0;
+		}
+
+		while (rc == 0 && done < count) {
+			char *id;
+
+			if ((rc = credis_pipeline_read_bulk(conn->redis, &id)) == 0) {
+				sent++;
+				done++;
+			} else if (redis_in_step(conn->redis, rc)) {
+				/* An error reply only fails this entry, it would be refused again. Anything else leaves the connection
+				   out of sync */
+				ledger_lost(entries[done++]);
+				rc = 0;
+			}
+		}
+
+		redis_checkin(conn, credis_pipeline_pending(conn->redis) > 0 ? CREDIS_ERR_RECV : rc);
+	}
+
+	stats_add(RN_STAT_LEDGER_WRITTEN, sent);
+
+	return done;
+}
+
+/* Sends whatever is buffered as soon as it's there, in batches of up to ledger_batch, so a busy ledger is written in a
+   few round trips and a quiet one without delay. What redis didn't take goes first in the next batch, after a backoff,
+   and is only logged as lost once it has failed for ledger_retry_ms or the ledger stops */
+static void *SWITCH_THREAD_FUNC ledger_thread(switch_thread_t *thread, void *obj)
+{
+	rednibble_ledger_entry_t **entries;
+	switch_time_t failing = 0;
+	void *pop;
+	int count = 0, done, backoff = 0, i;
+
+	switch_zmalloc(entries, sizeof(*entries) * globals.ledger_batch);
+
+	for (;;) {
+		if (!count && switch_queue_pop_timeout(globals.ledger_queue, &pop, 500000) == SWITCH_STATUS_SUCCESS) {
+			entries[count++] = pop;
+		}
+		while (count && count < globals.ledger_batch && switch_queue_trypop(globals.ledger_queue, &pop) == SWITCH_STATUS_SUCCESS) {
+			entries[count++] = pop;
+		}
+
+		if (!count) {
+			/* Only stop once everything queued before ledger_stop() is written */
+			if (!globals.ledger_running) {
+				break;
+			}
+			continue;
+		}
+
+		done = ledger_write(entries, count);
+
+		for (i = 0; i < done; i++) {
+			free(entries[i]);
+		}
+		count -= done;
+		memmove(entries, entries + done, sizeof(*entries) * count);
+
+		if (!count) {
+			failing = 0;
+			backoff = 0;
+			continue;
+		}
+
+		if (!failing) {
+			failing = switch_micro_time_now();
+		}
+
+		if (!globals.ledger_running || switch_micro_time_now() - failing >= (switch_time_t) globals.ledger_retry_ms * 1000) {
+			for (i = 0; i < count; i++) {
+				ledger_lost(entries[i]);
+				free(entries[i]);
+			}
+			count = 0;
+			failing = 0;
+			backoff = 0;
+			continue;
+		}
+
+		backoff = backoff ? backoff * 2 : RN_LEDGER_BACKOFF_MS;
+		if (backoff > RN_LEDGER_BACKOFF_MAX_MS) {
+			backoff = RN_LEDGER_BACKOFF_MAX_MS;
+		}
+		/* In slices, so ledger_stop() isn't held up */
+		for (i = 0; i < backoff && globals.ledger_running; i += 100) {
+			switch_yield(100000);
+		}
+	}
+
+	free(entries);
+
+	return NULL;
+}
+
+static void ledger_start(void)
+{
+	switch_threadattr_t *thd_attr = NULL;
+
+	if (zstr(globals.ledger_stream)) {
+		return;
+	}
+
+	switch_queue_create(&globals.ledger_queue, globals.ledger_queue_size, globals.pool);
+	globals.ledger_running = 1;
+
+	switch_threadattr_create(&thd_attr, globals.pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+	switch_thread_create(&globals.ledger_thread, thd_attr, ledger_thread, NULL, globals.pool);
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Writing charges to redis stream %s\n", globals.ledger_stream);
+}
+
+/* Call once nothing bills anymore, the ledger is written out first */
+static void ledger_stop(void)
+{
+	switch_status_t st;
+
+	if (!globals.ledger_thread) {
+		return;
+	}
+
+	globals.ledger_running = 0;
+	switch_thread_join(&st, globals.ledger_thread);
+	globals.ledger_thread = NULL;
+	globals.ledger_queue = NULL;
+}
+
+/* You can turn on session heartbeat on a channel to have us check billing more often */
+static void billing_heartbeat(const char *uuid)
+{
+	switch_core_session_t *session;
+
+	rednibble_charge_t *charge;
+	switch_bool_t claim_here = globals.billing_window > 0;
+
+	stats_count(RN_STAT_HEARTBEATS);
+
+#ifdef CREDIS_ASYNC
+	claim_here = claim_here || globals.redis_async;
+#endif
+
+	/* Claim the time to bill right here and pass the charge on without waiting for redis, a billing worker handles the outcome */
+	if (claim_here) {
+		if (!(session = billing_session_locate(uuid))) {
+			return;
+		}
+		charge = charge_prepare(session);
+		switch_core_session_rwunlock(session);
+
+		if (!charge) {
+			return;
+		}
+
+		if (charge->local) {
+			/* Paid from reserved credit */
+			charge_deliver(charge);
+		} else if (journal_waiting() && journal_charge(charge)) {
+			/* Behind debits redis hasn't got yet */
+			charge_deliver(charge);
+		} else if (globals.billing_window > 0) {
+			/* Leave it to the account's batch */
+			batch_add(charge);
+		}
+#ifdef CREDIS_ASYNC
+		else if (!breaker_allow(&charge->probe) || charge_submit(charge, SWITCH_FALSE) != SWITCH_STATUS_SUCCESS) {
+			/* Handled like any other failed debit */
+			charge_done(CREDIS_ERR_CONNECT, NULL, charge);
+		}
+#endif
+		return;
+	}
+
+	/* Hand the heartbeat to a billing worker so we don't hold up event delivery while talking to redis */
+	if (globals.billing_queue) {
+		rednibble_job_t *job;
+
+		switch_zmalloc(job, sizeof(*job));
+		job->uuid = strdup(uuid);
+		job->queued = switch_micro_time_now();
+
+		if (switch_queue_trypush(globals.billing_queue, job) != SWITCH_STATUS_SUCCESS) {
+			/* Nothing is lost, the next heartbeat bills the time since the last successful bill */
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Billing queue full, skipping heartbeat for %s\n", uuid);
+			switch_mutex_lock(globals.stats_mutex);
+			globals.jobs_dropped++;
+			switch_mutex_unlock(globals.stats_mutex);
+			billing_job_destroy(job);
+		}
+		return;
+	}
+
+	/* Get session var */
+	if (!(session = billing_session_locate(uuid))) {
+		return;
+	}
+
+	/* Go bill */
+	do_billing(session, NULL);
+
+	switch_core_session_rwunlock(session);
+}
+
+/* Heartbeats turned on for a channel by anything but us still bill it */
+static void event_handler(switch_event_t *event)
+{
+	char *uuid;
+
+	if (!event) {
+		/* We should never get here - it means an event came in without the event info */
+		return;
+	}
+
+	/* Make sure everything is sane */
+	if (!(uuid = switch_event_get_header(event, "Unique-ID"))) {
+		/* Donde esta channel? */
+		return;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Received request via %s!\n", switch_event_name(event->event_id));
+
+	/* Display debugging info */
+	if (switch_event_get_header(event, "rednibble_debug")) {
+		debug_event_handler(event);
+	}
+
+	billing_heartbeat(uuid);
+}
+
+/* Put a timer on the wheel according to how far off it is due. Called with the wheel mutex held */
+static void wheel_insert(rednibble_timer_t *timer)
+{
+	uint64_t delta = timer->expires - globals.wheel_now;
+	int level;
+
+	if (timer->expires < globals.wheel_now) {
+		/* Overdue, fire on the next tick */
+		timer->expires = globals.wheel_now + 1;
+		delta = 1;
+	}
+
+	for (level = 0; level < RN_WHEEL_LEVELS - 1; level++) {
+		if (delta < ((uint64_t) 1 << (RN_WHEEL_BITS * (level + 1)))) {
+			break;
+		}
+	}
+
+	/* Further off than the wheel reaches, park it in the top level and look again when it cascades */
+	if (delta >= ((uint64_t) 1 << (RN_WHEEL_BITS * RN_WHEEL_LEVELS))) {
+		timer->slot = &globals.wheel[level][((globals.wheel_now >> (RN_WHEEL_BITS * level)) - 1) & RN_WHEEL_MASK];
+	} else {
+		timer->slot = &globals.wheel[level][(timer->expires >> (RN_WHEEL_BITS * level)) & RN_WHEEL_MASK];
+	}
+
+	timer->prev = NULL;
+	if ((timer->next = *timer->slot)) {
+		timer->next->prev = timer;
+	}
+	*timer->slot = timer;
+}
+
+static void wheel_remove(rednibble_timer_t *timer)
+{
+	if (timer->prev) {
+		timer->prev->next = timer->next;
+	} else {
+		*timer->slot = timer->next;
+	}
+	if (timer->next) {
+		timer->next->prev = timer->prev;
+	}
+	timer->prev = timer->next = NULL;
+	timer->slot = NULL;
+}
+
+/* Move the timers of a higher level slot down to where they belong now */
+static void wheel_cascade(int level)
+{
+	rednibble_timer_t **slot = &globals.wheel[level][(globals.wheel_now >> (RN_WHEEL_BITS * level)) & RN_WHEEL_MASK];
+	rednibble_timer_t *timer = *slot, *next;
+
+	*slot = NULL;
+	for (; timer; timer = next) {
+		next = timer->next;
+		wheel_insert(timer);
+	}
+}
+
+/* Advance the wheel by one tick and bill the sessions that are due */
+static void wheel_tick(void)
+{
+	rednibble_timer_t *timer, *next, **slot;
+	char (*due)[SWITCH_UUID_FORMATTED_LENGTH + 1] = NULL;
+	int count = 0, size = 0, level, i;
+
+	switch_mutex_lock(globals.wheel_mutex);
+
+	globals.wheel_now++;
+
+	/* Every time a level wraps around, the next one up hands down its current slot */
+	for (level = 1; level < RN_WHEEL_LEVELS; level++) {
+		if (globals.wheel_now & (((uint64_t) 1 << (RN_WHEEL_BITS * level)) - 1)) {
+			break;
+		}
+	}
+	while (--level > 0) {
+		wheel_cascade(level);
+	}
+
+	slot = &globals.wheel[0][globals.wheel_now & RN_WHEEL_MASK];
+	for (timer = *slot; timer; timer = next) {
+		next = timer->next;
+
+		if (timer->expires > globals.wheel_now) {
+			continue;
+		}
+
+		if (count == size) {
+			size = size ? size * 2 : 64;
+			due = realloc(due, size * sizeof(*due));
+			switch_assert(due);
+		}
+		switch_copy_string(due[count++], timer->uuid, sizeof(*due));
+
+		/* Periodic ones go back on for the next beat */
+		wheel_remove(timer);
+		if (timer->interval) {
+			timer->expires = globals.wheel_now + timer->interval;
+			wheel_insert(timer);
+		}
+	}
+
+	switch_mutex_unlock(globals.wheel_mutex);
+
+	/* Billing locates the session, which must not happen with the wheel locked against hangups cancelling their timer */
+	for (i = 0; i < count; i++) {
+		billing_heartbeat(due[i]);
+	}
+
+	switch_safe_free(due);
+}
+
+static void *SWITCH_THREAD_FUNC wheel_thread(switch_thread_t *thread, void *obj)
+{
+	switch_time_t next = switch_micro_time_now() + RN_WHEEL_TICK_MS * 1000;
+
+	while (globals.wheel_running) {
+		switch_time_t now = switch_micro_time_now();
+
+		if (now < next) {
+			switch_yield(next - now);
+			continue;
+		}
+
+		/* Catch up on ticks missed while billing took long, rather than drifting */
+		wheel_tick();
+		next += RN_WHEEL_TICK_MS * 1000;
+	}
+
+	return NULL;
+}
+
+static void wheel_start(void)
+{
+	switch_threadattr_t *thd_attr = NULL;
+
+	switch_mutex_init(&globals.wheel_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+	globals.wheel_running = 1;
+
+	switch_threadattr_create(&thd_attr, globals.pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+	switch_thread_create(&globals.wheel_thread, thd_attr, wheel_thread, NULL, globals.pool);
+}
+
+static void wheel_stop(void)
+{
+	rednibble_timer_t *timer, *next;
+	switch_status_t st;
+	int level, i;
+
+	if (!globals.wheel_thread) {
+		return;
+	}
+
+	globals.wheel_running = 0;
+	switch_thread_join(&st, globals.wheel_thread);
+	globals.wheel_thread = NULL;
+
+	/* Sessions may still point at their timer */
+	switch_mutex_lock(globals.wheel_mutex);
+	for (level = 0; level < RN_WHEEL_LEVELS; level++) {
+		for (i = 0; i < RN_WHEEL_SLOTS; i++) {
+			for (timer = globals.wheel[level][i]; timer; timer = next) {
+				next = timer->next;
+				timer->slot = NULL;
+			}
+			globals.wheel[level][i] = NULL;
+		}
+	}
+	switch_mutex_unlock(globals.wheel_mutex);
+}
+
+/* Put the session's timer `name' on the wheel to fire `delay' ticks from now, and every `interval' ticks after that
+   (0 fires just once). A delay of 0 takes it off the wheel */
+static void wheel_set(switch_core_session_t *session, const char *name, uint64_t delay, uint32_t interval)
+{
+	switch_channel_t *channel = switch_core_session_get_channel(session);
+	rednibble_timer_t *timer;
+
+	switch_mutex_lock(globals.wheel_mutex);
+
+	timer = (rednibble_timer_t *) switch_channel_get_private(channel, name);
+
+	if (!timer && delay > 0) {
+		timer = switch_core_session_alloc(session, sizeof(*timer));
+		memset(timer, 0, sizeof(*timer));
+		switch_copy_string(timer->uuid, switch_core_session_get_uuid(session), sizeof(timer->uuid));
+		switch_channel_set_private(channel, name, timer);
+	}
+
+	if (timer) {
+		if (timer->slot) {
+			wheel_remove(timer);
+		}
+		if (delay > 0 && globals.wheel_running) {
+			timer->interval = interval;
+			timer->expires = globals.wheel_now + delay;
+			wheel_insert(timer);
+		}
+	}
+
+	switch_mutex_unlock(globals.wheel_mutex);
+}
+
+/* Bill this session every `seconds' from now on, 0 stops it. Replaces switch_core_session_enable_heartbeat(),
+   which sends a heartbeat event through the whole event system for every beat */
+static void billing_timer_schedule(switch_core_session_t *session, int seconds)
+{
+	uint32_t ticks = seconds > 0 ? seconds * (1000 / RN_WHEEL_TICK_MS) : 0;
+
+	wheel_set(session, "_rednibble_timer_", ticks, ticks);
+}
+
+/* Bill this session once at `when', replacing the previous deadline. 0 cancels it */
+static void billing_deadline_set(switch_core_session_t *session, switch_time_t when)
+{
+	switch_time_t now = switch_micro_time_now();
+	uint64_t ticks = 0;
+
+	if (when > 0) {
+		/* Round up, by then the threshold has been crossed */
+		ticks = when > now ? (uint64_t) ((when - now + RN_WHEEL_TICK_MS * 1000 - 1) / (RN_WHEEL_TICK_MS * 1000)) : 1;
+	}
+
+	wheel_set(session, "_rednibble_deadline_", ticks, 0);
+}
+
+/* The timers live in the session's pool, so they have to come off the wheel before the session goes away */
+static switch_status_t billing_timer_cancel(switch_core_session_t *session)
+{
+	billing_timer_schedule(session, 0);
+	billing_deadline_set(session, 0);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static void *SWITCH_THREAD_FUNC billing_worker(switch_thread_t *thread, void *obj)
+{
+	void *pop = NULL;
+
+	while (globals.running) {
+		if (switch_queue_pop_timeout(globals.billing_queue, &pop, 500000) != SWITCH_STATUS_SUCCESS || !pop) {
+			continue;
+		}
+
+		billing_job_run((rednibble_job_t *) pop);
+	}
+
+	return NULL;
+}
+
+static void billing_workers_start(void)
+{
+	switch_threadattr_t *thd_attr = NULL;
+	int i;
+
+	if (globals.billing_threads < 1) {
+		return;
+	}
+
+	switch_queue_create(&globals.billing_queue, globals.billing_queue_size, globals.pool);
+	globals.billing_workers = switch_core_alloc(globals.pool, sizeof(switch_thread_t *) * globals.billing_threads);
+	globals.running = 1;
+
+	switch_threadattr_create(&thd_attr, globals.pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+
+	for (i = 0; i < globals.billing_threads; i++) {
+		switch_thread_create(&globals.billing_workers[i], thd_attr, billing_worker, NULL, globals.pool);
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Started %d billing workers\n", globals.billing_threads);
+}
+
+static void billing_workers_stop(void)
+{
+	switch_status_t st;
+	void *pop = NULL;
+	int i;
+
+	if (!globals.billing_queue) {
+		return;
+	}
+
+	globals.running = 0;
+	switch_queue_interrupt_all(globals.billing_queue);
+
+	for (i = 0; i < globals.billing_threads; i++) {
+		switch_thread_join(&st, globals.billing_workers[i]);
+	}
+
+	/* Heartbeats still queued are dropped, calls still up get billed at hangup */
+	while (switch_queue_trypop(globals.billing_queue, &pop) == SWITCH_STATUS_SUCCESS && pop) {
+		billing_job_destroy((rednibble_job_t *) pop);
+	}
+
+	globals.billing_queue = NULL;
+}
+
+static void billing_workers_status(switch_stream_handle_t *stream)
+{
+	uint64_t done, dropped, batch_charges, batch_commands;
+	switch_time_t wait_total, run_total, run_max;
+	rednibble_timer_t *timer;
+	int timers = 0, level, i;
+
+	switch_mutex_lock(globals.wheel_mutex);
+	for (level = 0; level < RN_WHEEL_LEVELS; level++) {
+		for (i = 0; i < RN_WHEEL_SLOTS; i++) {
+			for (timer = globals.wheel[level][i]; timer; timer = timer->next) {
+				timers++;
+			}
+		}
+	}
+	switch_mutex_unlock(globals.wheel_mutex);
+
+	switch_mutex_lock(globals.stats_mutex);
+	done = globals.jobs_done;
+	dropped = globals.jobs_dropped;
+	wait_total = globals.jobs_wait_total;
+	run_total = globals.jobs_run_total;
+	run_max = globals.jobs_run_max;
+	batch_charges = globals.batch_charges;
+	batch_commands = globals.batch_commands;
+	switch_mutex_unlock(globals.stats_mutex);
+
+	stream->write_function(stream, "billing_timers: %d\n", timers);
+	stream->write_function(stream, "billing_threads: %d\n", globals.billing_threads);
+	stream->write_function(stream, "queue_depth: %u/%d\n", globals.billing_queue ? switch_queue_size(globals.billing_queue) : 0,
+						   globals.billing_queue_size);
+	stream->write_function(stream, "heartbeats_billed: %" SWITCH_UINT64_T_FMT "\n", done);
+	stream->write_function(stream, "heartbeats_dropped: %" SWITCH_UINT64_T_FMT "\n", dropped);
+	stream->write_function(stream, "avg_queue_wait_us: %" SWITCH_INT64_T_FMT "\n", done ? wait_total / (switch_time_t) done : 0);
+	stream->write_function(stream, "avg_billing_us: %" SWITCH_INT64_T_FMT "\n", done ? run_total / (switch_time_t) done : 0);
+	stream->write_function(stream, "max_billing_us: %" SWITCH_INT64_T_FMT "\n", run_max);
+#ifdef CREDIS_ASYNC
+	if (globals.redis_async) {
+		stream->write_function(stream, "redis_async_pending: %d\n", credis_async_pending(globals.redis_async));
+	}
+#endif
+#ifdef CREDIS_FAULTS
+	stream->write_function(stream, "redis_faults: latency %d+%dms stall %d/1000 for %dms drop %d/1000 partial %d/1000 error %d/1000 seed %u\n",
+						   globals.redis_faults.latency_ms, globals.redis_faults.jitter_ms, globals.redis_faults.stall_permille,
+						   globals.redis_faults.stall_ms, globals.redis_faults.drop_permille, globals.redis_faults.partial_permille,
+						   globals.redis_faults.error_permille, globals.redis_faults.seed);
+#endif
+	if (globals.breaker_failure_pct) {
+		static const char *breaker_states[] = { "closed", "open", "half-open" };
+
+		switch_mutex_lock(globals.breaker_mutex);
+		stream->write_function(stream, "redis_breaker: %s, %d of %d calls failed\n", breaker_states[globals.breaker_state], globals.breaker_failures,
+							   globals.breaker_calls);
+		switch_mutex_unlock(globals.breaker_mutex);
+	}
+	if (globals.journal_file && !zstr(globals.journal_file)) {
+		stream->write_function(stream, "journal_waiting: %d\n", journal_waiting());
+	}
+	if (globals.ledger_queue) {
+		stream->write_function(stream, "ledger_queue_depth: %u/%d\n", switch_queue_size(globals.ledger_queue), globals.ledger_queue_size);
+	}
+	if (globals.billing_window > 0) {
+		stream->write_function(stream, "billing_window_ms: %d\n", globals.billing_window);
+		stream->write_function(stream, "batched_charges: %" SWITCH_UINT64_T_FMT "\n", batch_charges);
+		stream->write_function(stream, "batched_commands: %" SWITCH_UINT64_T_FMT "\n", batch_commands);
+	}
+}
+
+static int hist_index(switch_time_t us)
+{
+	int msb;
+
+	if (us < 8) {
+		return us < 0 ? 0 : (int) us;
+	}
+
+	msb = 63 - __builtin_clzll((unsigned long long) us);
+	return (msb - 2) * 8 + (int) ((us >> (msb - 3)) & 7);
+}
+
+/* Smallest value that lands in bucket i */
+static switch_time_t hist_value(int i)
+{
+	return i < 8 ? i : (switch_time_t) (8 + i % 8) << (i / 8 - 1);
+}
+
+static void hist_add(rednibble_hist_t *hist, switch_time_t us)
+{
+	int i = hist_index(us);
+
+	hist->count[i < RN_HIST_BUCKETS ? i : RN_HIST_BUCKETS - 1]++;
+	hist->total++;
+	hist->sum += us;
+	if (us > hist->max) {
+		hist->max = us;
+	}
+}
+
+static void hist_merge(rednibble_hist_t *into, const rednibble_hist_t *hist)
+{
+	int i;
+
+	for (i = 0; i < RN_HIST_BUCKETS; i++) {
+		into->count[i] += hist->count[i];
+	}
+	into->total += hist->total;
+	into->sum += hist->sum;
+	if (hist->max > into->max) {
+		into->max = hist->max;
+	}
+}
+
+/* Latency below which permille of the samples fall, rounded up to the end of its bucket */
+static switch_time_t hist_percentile(const rednibble_hist_t *hist, int permille)
+{
+	uint64_t want = (hist->total * permille + 999) / 1000, seen = 0;
+	int i;
+
+	for (i = 0; i < RN_HIST_BUCKETS; i++) {
+		if ((seen += hist->count[i]) >= want && seen) {
+			switch_time_t end = i + 1 < RN_HIST_BUCKETS ? hist_value(i + 1) - 1 : hist->max;
+			return end < hist->max ? end : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+static const char *stats_latency_names[RN_LAT_COUNT] = { "redis_connect", "redis_decrby", "redis_get", "redis_script", "billing", "lock_wait" };
+static const char *stats_counter_names[RN_STAT_COUNT] = { "heartbeats", "bill_failures", "nobal_transfers", "lowbal_actions", "percall_transfers",
+	"ledger_written", "ledger_dropped", "ledger_failed", "breaker_opened", "breaker_rejected", "degraded_denied"
+};
+
+/* The calling thread's shard. Threads may share one, the atomic adds keep that safe */
+static rednibble_stats_t *stats_shard(void)
+{
+	uint64_t id = (uint64_t) (uintptr_t) switch_thread_self();
+
+	return &globals.stats[(id * UINT64_C(0x9E3779B97F4A7C15)) >> 60];
+}
 
-	double balance = 0.0;
+static void stats_latency(rednibble_latency_t which, switch_time_t us)
+{
+	rednibble_hist_t *hist;
+	switch_time_t max;
+	int i;
 
-	if (redis_factory(&redis) != SWITCH_STATUS_SUCCESS) {
-		return SWITCH_STATUS_FALSE;
+	if (!globals.stats) {
+		return;
 	}
 
-       	rediskey = switch_mprintf("rn_%s", billaccount);
+	hist = &stats_shard()->latency[which];
+	i = hist_index(us);
 
-	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Looking up redis key %s\n", rediskey);
+	__atomic_fetch_add(&hist->count[i < RN_HIST_BUCKETS ? i : RN_HIST_BUCKETS - 1], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->total, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum, us, __ATOMIC_RELAXED);
 
-	result = credis_get(redis, rediskey, &str);
+	max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	while (us > max && !__atomic_compare_exchange_n(&hist->max, &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
 
-	if (result != 0) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "ERR: Could not get redis value on key %s (got result %d) - returning positive value for now (FIXME)\n", rediskey, result);
-		balance = 1.0;
-	} else {
-		val = atof(str);
-		balance = val/1000000;
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Key %s returned %s converted to %e / %f \n", rediskey, str, val, balance);
+static void stats_add(rednibble_counter_t which, uint64_t n)
+{
+	if (globals.stats) {
+		__atomic_fetch_add(&stats_shard()->counter[which], n, __ATOMIC_RELAXED);
 	}
+}
 
-	switch_safe_free(rediskey);
-	credis_close(redis);
-
-	return balance;
+static void stats_count(rednibble_counter_t which)
+{
+	stats_add(which, 1);
 }
 
-/* This is where we actually charge the guy 
-  This can be called anytime a call is in progress or at the end of a call before the session is destroyed */
-static switch_status_t do_billing(switch_core_session_t *session)
+/* Add up the shards into stats, and zero them if reset is set. Samples added while this runs land on either side of a reset */
+static void stats_collect(rednibble_stats_t *stats, switch_bool_t reset)
 {
-	/* FS vars we will use */
-	switch_channel_t *channel;
-	switch_caller_profile_t *profile;
+	switch_time_t max;
+	int shard, which, i;
 
-	/* Local vars */
-	rednibble_data_t *rednibble_data;
-	switch_time_t ts = switch_micro_time_now();
-	double billamount;
-	char date[80] = "";
-	char *uuid;
-	switch_size_t retsize;
-	switch_time_exp_t tm;
-	const char *billrate;
-	const char *billincrement;
-	const char *billaccount;
-	double nobal_amt = globals.nobal_amt;
-	double lowbal_amt = globals.lowbal_amt;
-	double balance;
+	memset(stats, 0, sizeof(*stats));
 
-	if (!session) {
-		/* Why are we here? */
-		return SWITCH_STATUS_SUCCESS;
-	}
+	for (shard = 0; shard < RN_STATS_SHARDS; shard++) {
+		rednibble_stats_t *from = &globals.stats[shard];
 
-	uuid = switch_core_session_get_uuid(session);
+		for (which = 0; which < RN_LAT_COUNT; which++) {
+			rednibble_hist_t *hist = &from->latency[which], *into = &stats->latency[which];
 
-	/* Get channel var */
-	if (!(channel = switch_core_session_get_channel(session))) {
-		return SWITCH_STATUS_SUCCESS;
-	}
+			for (i = 0; i < RN_HIST_BUCKETS; i++) {
+				into->count[i] += reset ? __atomic_exchange_n(&hist->count[i], 0, __ATOMIC_RELAXED) : __atomic_load_n(&hist->count[i], __ATOMIC_RELAXED);
+			}
+			into->total += reset ? __atomic_exchange_n(&hist->total, 0, __ATOMIC_RELAXED) : __atomic_load_n(&hist->total, __ATOMIC_RELAXED);
+			into->sum += reset ? __atomic_exchange_n(&hist->sum, 0, __ATOMIC_RELAXED) : __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+			max = reset ? __atomic_exchange_n(&hist->max, 0, __ATOMIC_RELAXED) : __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+			if (max > into->max) {
+				into->max = max;
+			}
+		}
 
-	/* Variables kept in FS but relevant only to this module */
-	billrate = switch_channel_get_variable(channel, "rednibble_rate");
-	billincrement = switch_channel_get_variable(channel, "rednibble_increment");
-	billaccount = switch_channel_get_variable(channel, "rednibble_account");
-	
-	if (!zstr(switch_channel_get_variable(channel, "nobal_amt"))) {
-		nobal_amt = atof(switch_channel_get_variable(channel, "nobal_amt"));
-	}
-	
-	if (!zstr(switch_channel_get_variable(channel, "lowbal_amt"))) {
-		lowbal_amt = atof(switch_channel_get_variable(channel, "lowbal_amt"));
-	}
-	
-	/* Return if there's no billing information on this session */
-	if (!billrate || !billaccount) {
-		return SWITCH_STATUS_SUCCESS;
+		for (which = 0; which < RN_STAT_COUNT; which++) {
+			stats->counter[which] += reset ? __atomic_exchange_n(&from->counter[which], 0, __ATOMIC_RELAXED) :
+				__atomic_load_n(&from->counter[which], __ATOMIC_RELAXED);
+		}
 	}
+}
 
-	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Attempting to bill at %s per minute to account %s\n", billrate,
-					  billaccount);
+#define STATS_SYNTAX "stats [json] [reset]"
 
-	/* Get caller profile info from channel */
-	profile = switch_channel_get_caller_profile(channel);
+/* "rednibblebill stats": counters and latency percentiles since load or the last reset, as text or JSON */
+static void stats_show(int argc, char **argv, switch_stream_handle_t *stream)
+{
+	rednibble_stats_t *stats;
+	switch_bool_t json = SWITCH_FALSE, reset = SWITCH_FALSE;
+	switch_time_t now = switch_micro_time_now(), since;
+	int which, i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcasecmp(argv[i], "json")) {
+			json = SWITCH_TRUE;
+		} else if (!strcasecmp(argv[i], "reset")) {
+			reset = SWITCH_TRUE;
+		} else {
+			stream->write_function(stream, "-USAGE: %s\n", STATS_SYNTAX);
+			return;
+		}
+	}
 
-	if (!profile || !profile->times) {
-		/* No caller profile (why would this happen?) */
-		return SWITCH_STATUS_SUCCESS;
+	if (!globals.stats) {
+		stream->write_function(stream, "-ERR Stats not available\n");
+		return;
 	}
 
-	if (profile->times->answered < 1) {
-		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Not billing %s - call is not in answered state\n", billaccount);
+	/* Too big for the stack of some threads */
+	switch_zmalloc(stats, sizeof(*stats));
 
-		/* See if this person has enough money left to continue the call */
-		balance = get_balance(billaccount, channel);
-		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Comparing %f to hangup balance of %f\n", balance, nobal_amt);
-		if (balance <= nobal_amt) {
-			/* Not enough money - reroute call to nobal location */
-			switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Balance of %f fell below allowed amount of %f! (Account %s)\n",
-							  balance, nobal_amt, billaccount);
+	switch_mutex_lock(globals.stats_mutex);
+	stats_collect(stats, reset);
+	since = globals.stats_since;
+	if (reset) {
+		globals.stats_since = now;
+	}
+	switch_mutex_unlock(globals.stats_mutex);
 
-			transfer_call(session, globals.nobal_action);
+	if (json) {
+		stream->write_function(stream, "{\"seconds\":%" SWITCH_INT64_T_FMT ",\"counters\":{", (now - since) / 1000000);
+		for (which = 0; which < RN_STAT_COUNT; which++) {
+			stream->write_function(stream, "%s\"%s\":%" SWITCH_UINT64_T_FMT, which ? "," : "", stats_counter_names[which], stats->counter[which]);
 		}
+		stream->write_function(stream, "},\"latency_us\":{");
+	} else {
+		stream->write_function(stream, "seconds: %" SWITCH_INT64_T_FMT "\n", (now - since) / 1000000);
+		for (which = 0; which < RN_STAT_COUNT; which++) {
+			stream->write_function(stream, "%s: %" SWITCH_UINT64_T_FMT "\n", stats_counter_names[which], stats->counter[which]);
+		}
+	}
 
-		return SWITCH_STATUS_SUCCESS;
+	for (which = 0; which < RN_LAT_COUNT; which++) {
+		rednibble_hist_t *hist = &stats->latency[which];
+		switch_time_t avg = hist->total ? hist->sum / (switch_time_t) hist->total : 0;
+
+		if (json) {
+			stream->write_function(stream, "%s\"%s\":{\"count\":%" SWITCH_UINT64_T_FMT ",\"avg\":%" SWITCH_INT64_T_FMT ",\"p50\":%" SWITCH_INT64_T_FMT
+								   ",\"p90\":%" SWITCH_INT64_T_FMT ",\"p99\":%" SWITCH_INT64_T_FMT ",\"p999\":%" SWITCH_INT64_T_FMT ",\"max\":%" SWITCH_INT64_T_FMT "}",
+								   which ? "," : "", stats_latency_names[which], hist->total, avg, hist_percentile(hist, 500), hist_percentile(hist, 900),
+								   hist_percentile(hist, 990), hist_percentile(hist, 999), hist->max);
+		} else {
+			stream->write_function(stream, "%s_us: count %" SWITCH_UINT64_T_FMT " avg %" SWITCH_INT64_T_FMT " p50 %" SWITCH_INT64_T_FMT " p90 %" SWITCH_INT64_T_FMT
+								   " p99 %" SWITCH_INT64_T_FMT " p99.9 %" SWITCH_INT64_T_FMT " max %" SWITCH_INT64_T_FMT "\n", stats_latency_names[which], hist->total,
+								   avg, hist_percentile(hist, 500), hist_percentile(hist, 900), hist_percentile(hist, 990), hist_percentile(hist, 999), hist->max);
+		}
 	}
 
-	/* Lock this session's data for this module while we tinker with it */
-	if (globals.mutex) {
-		switch_mutex_lock(globals.mutex);
+	if (json) {
+		stream->write_function(stream, "}}\n");
 	}
 
-	/* Get our rednibble data var. This will be NULL if it's our first call here for this session */
-	rednibble_data = (rednibble_data_t *) switch_channel_get_private(channel, "_rednibble_data_");
+	free(stats);
+}
 
-	/* Are we in paused mode? If so, we don't do anything here - go back! */
-	if (rednibble_data && (rednibble_data->pausets > 0)) {
-		if (globals.mutex) {
-			switch_mutex_unlock(globals.mutex);
-		}
-		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Received heartbeat, but we're paused - ignoring\n");
-		return SWITCH_STATUS_SUCCESS;
+/* CPU time used by the whole process, in microseconds */
+static switch_time_t bench_cpu_time(void)
+{
+#ifndef WIN32
+	struct rusage ru;
+
+	if (!getrusage(RUSAGE_SELF, &ru)) {
+		return (switch_time_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
 	}
+#endif
+	return 0;
+}
 
-	/* Have we done any billing on this channel yet? If no, set up vars for doing so */
-	if (!rednibble_data) {
-		rednibble_data = switch_core_session_alloc(session, sizeof(*rednibble_data));
-		memset(rednibble_data, 0, sizeof(*rednibble_data));
+/* Debit a bench account on the bench thread's own connection, opened as needed. The bench stays clear of the connection pool,
+   the breaker and the journal, so it can't fail real calls over to the journal nor leave debits there to be replayed later */
+static int bench_debit(REDIS *redis, const char *key, rednibble_money_t amount)
+{
+	long long val;
+	int rc;
 
-		/* Setup new billing data (based on call answer time, in case this module started late with active calls) */
-		rednibble_data->lastts = profile->times->answered;	/* Set the initial answer time to match when the call was really answered */
-		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Beginning new billing on %s\n", uuid);
+	if (!*redis && !(*redis = credis_connect(globals.redis_host, globals.redis_port, globals.redis_timeout))) {
+		return CREDIS_ERR_CONNECT;
 	}
 
-	switch_time_exp_lt(&tm, rednibble_data->lastts);
-	switch_strftime_nocheck(date, &retsize, sizeof(date), "%Y-%m-%d %T", &tm);
+	if ((rc = credis_decrby64(*redis, key, amount, &val)) != 0 && !redis_in_step(*redis, rc)) {
+		credis_close(*redis);
+		*redis = NULL;
+	}
 
-	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "%d seconds passed since last bill time of %s\n",
-					  (int) ((ts - rednibble_data->lastts) / 1000000), date);
+	return rc;
+}
 
-	if ((ts - rednibble_data->lastts) >= 0) {
-		/* If billincrement is set we bill by it and not by time elapsed */
-		if (!(switch_strlen_zero(billincrement))) {
-			switch_time_t chargedunits = (ts - rednibble_data->lastts) / 1000000 <= atol(billincrement) ? atol(billincrement) * 1000000 : (switch_time_t)(ceil((ts - rednibble_data->lastts) / (atol(billincrement) * 1000000.0))) * atol(billincrement) * 1000000;
-			billamount = (atof(billrate) / 1000000 / 60) * chargedunits - rednibble_data->bill_adjustments;
-			/* Account for the prepaid amount */
-			rednibble_data->lastts += chargedunits;
-		} else {		
-			/* Convert billrate into microseconds and multiply by # of microseconds that have passed since last *successful* bill */
-			billamount = (atof(billrate) / 1000000 / 60) * ((ts - rednibble_data->lastts)) - rednibble_data->bill_adjustments;
-			/* Update the last time we billed */
-			rednibble_data->lastts = ts;
-		}
-
-		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Billing %f to %s (Call: %s / %f so far)\n", billamount, billaccount,
-						  uuid, rednibble_data->total);
-
-		/* DO BILLING HERE and reset counters if it's successful! */
-		if (bill_event(billamount, billaccount, channel) == SWITCH_STATUS_SUCCESS) {
-			/* Increment total cost */
-			rednibble_data->total += billamount;
+/* Debit a slice of the simulated calls at their heartbeats, each call on its own RN_BENCH_KEY_FMT key */
+static void *SWITCH_THREAD_FUNC bench_worker(switch_thread_t *thread, void *obj)
+{
+	rednibble_bench_worker_t *worker = (rednibble_bench_worker_t *) obj;
+	rednibble_bench_t *bench = worker->bench;
+	switch_time_t end = bench->start + bench->duration;
+	switch_time_t *lastts, *next;
+	rednibble_money_t *reserved;
+	REDIS redis = NULL;
+	char key[32];
+	int i;
+
+	switch_zmalloc(lastts, sizeof(*lastts) * worker->count);
+	switch_zmalloc(next, sizeof(*next) * worker->count);
+	switch_zmalloc(reserved, sizeof(*reserved) * worker->count);
+
+	/* Spread the answer times so the heartbeats don't all come at once */
+	for (i = 0; i < worker->count; i++) {
+		lastts[i] = bench->start + bench->skew * (worker->first + i) / bench->calls;
+		next[i] = lastts[i] + bench->heartbeat;
+	}
 
-			/* Reset manual billing adjustments from pausing */
-			rednibble_data->bill_adjustments = 0;
+	while (switch_micro_time_now() < end) {
+		switch_time_t now = switch_micro_time_now(), due = end;
 
-			/* Update channel variable with current billing */
-			switch_channel_set_variable_printf(channel, "rednibble_total_billed", "%f", rednibble_data->total);
-		} else {
-			switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_CRIT, "Failed to log to database!\n");
-		}
-	} else {
-		if (switch_strlen_zero(billincrement))
-			switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "Just tried to bill %s negative minutes! That should be impossible.\n", uuid);
-	}
+		for (i = 0; i < worker->count; i++) {
+			rednibble_money_t amount, debit;
+			rednibble_money_t chunk = globals.reserve_us > 0 ? money_for_time(bench->rate, globals.reserve_us) : 0;
+			switch_time_t billed, started;
 
-	/* Save this location */
-	if (channel) {
-		switch_channel_set_private(channel, "_rednibble_data_", rednibble_data);
-
-		/* don't verify balance and transfer to nobal if we're done with call */
-		if (switch_channel_get_state(channel) != CS_REPORTING && switch_channel_get_state(channel) != CS_HANGUP) {
-			
-			balance = get_balance(billaccount, channel);
-			
-			/* See if we've achieved low balance */
-			if (!rednibble_data->lowbal_action_executed && balance <= lowbal_amt) {
-				switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Balance of %f fell below low balance amount of %f! (Account %s)\n",
-								  balance, lowbal_amt, billaccount);
-
-				if (exec_app(session, globals.lowbal_action) != SWITCH_STATUS_SUCCESS)
-					switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Low balance action didn't execute\n");
-				else
-					rednibble_data->lowbal_action_executed = 1;
+			if (next[i] > now) {
+				due = next[i] < due ? next[i] : due;
+				continue;
 			}
 
-			/* See if this person has enough money left to continue the call */
-			if (balance <= nobal_amt) {
-				/* Not enough money - reroute call to nobal location */
-				switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_CRIT, "Balance of %f fell below allowed amount of %f! (Account %s)\n",
-								  balance, nobal_amt, billaccount);
-
-				/* IMPORTANT: Billing must be paused before the transfer occurs! This prevents infinite loops, since the transfer will result */
-				/* in rednibblebill checking the call again in the routing process for an allowed balance! */
-				/* If you intend to give the user the option to re-up their balance, you must clear & resume billing once the balance is updated! */
-				rednibblebill_pause(session);
-				transfer_call(session, globals.nobal_action);
+			amount = billing_period(bench->rate, bench->increment, switch_micro_time_now() - lastts[i], &billed);
+			lastts[i] += billed;
+			debit = amount;
+
+			/* Only heartbeats that reserved credit doesn't pay go to redis, and only they are timed */
+			if (!chunk || !reservation_spend(&reserved[i], amount, chunk, &debit)) {
+				switch_snprintf(key, sizeof(key), RN_BENCH_KEY_FMT, worker->first + i);
+				worker->commands++;
+				started = switch_micro_time_now();
+				if (bench_debit(&redis, key, debit) == 0) {
+					reserved[i] += chunk;
+				} else {
+					worker->failures++;
+				}
+				hist_add(&worker->hist, switch_micro_time_now() - started);
 			}
-		}
-	}
 
+			worker->heartbeats++;
+			next[i] += bench->heartbeat;
+			due = next[i] < due ? next[i] : due;
+		}
 
-	/* Done changing - release lock */
-	if (globals.mutex) {
-		switch_mutex_unlock(globals.mutex);
+		if (due > (now = switch_micro_time_now())) {
+			switch_yield(due - now < 10000 ? due - now : 10000);
+		}
 	}
 
-	/* Go check if this call is allowed to continue */
-
-	return SWITCH_STATUS_SUCCESS;
+	if (redis) {
+		credis_close(redis);
+	}
+	free(lastts);
+	free(next);
+	free(reserved);
+	return NULL;
 }
 
-/* You can turn on session heartbeat on a channel to have us check billing more often */
-static void event_handler(switch_event_t *event)
-{
-	switch_core_session_t *session;
-	char *uuid;
+#define BENCH_SYNTAX "bench <calls> <seconds> [<heartbeat_ms> [<rate> [<increment> [<skew_ms> [<threads>]]]]]"
 
-	if (!event) {
-		/* We should never get here - it means an event came in without the event info */
+/* A load generator for redis: DECRBY the heartbeat charges of simulated calls for a while and report what redis took to
+   answer. The charges are worked out as for real calls (increments and reserve_minutes included), but none of the
+   module's billing path runs, no session, profile, balance check, script, batch or asynchronous client. So the numbers
+   are redis and network capacity, not what a heartbeat costs the module. Blocks the caller for the run */
+static void bench_run(int argc, char **argv, switch_stream_handle_t *stream)
+{
+	rednibble_bench_t bench = { 0 };
+	rednibble_bench_worker_t *workers;
+	switch_thread_t **threads;
+	switch_threadattr_t *thd_attr = NULL;
+	switch_memory_pool_t *pool;
+	switch_status_t st;
+	rednibble_hist_t hist = { { 0 } };
+	uint64_t heartbeats = 0, commands = 0, failures = 0;
+	switch_time_t cpu, elapsed;
+	REDIS redis;
+	char key[32];
+	int i;
+
+	bench.calls = argc > 1 ? atoi(argv[1]) : 0;
+	bench.duration = argc > 2 ? (switch_time_t) atoi(argv[2]) * 1000000 : 0;
+	bench.heartbeat = (switch_time_t) (argc > 3 ? atoi(argv[3]) : (globals.global_heartbeat > 0 ? globals.global_heartbeat : 60) * 1000) * 1000;
+	bench.rate = argc > 4 ? money_parse(argv[4]) : RN_MONEY_SCALE;
+	bench.increment = argc > 5 ? (switch_time_t) atoi(argv[5]) * 1000000 : 0;
+	bench.skew = argc > 6 ? (switch_time_t) atoi(argv[6]) * 1000 : bench.heartbeat;
+	bench.threads = argc > 7 ? atoi(argv[7]) : globals.redis_pool_size;
+
+	if (bench.calls < 1 || bench.duration <= 0 || bench.heartbeat <= 0 || bench.threads < 1 || bench.increment < 0 || bench.skew < 0) {
+		stream->write_function(stream, "-USAGE: %s\n", BENCH_SYNTAX);
 		return;
 	}
 
-	/* Make sure everything is sane */
-	if (!(uuid = switch_event_get_header(event, "Unique-ID"))) {
-		/* Donde esta channel? */
+	/* Redis is down or still catching up on the journal, don't add to its load */
+	if (journal_waiting()) {
+		stream->write_function(stream, "-ERR %d journaled debits are waiting for redis\n", journal_waiting());
 		return;
 	}
 
-	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Received request via %s!\n", switch_event_name(event->event_id));
+	if (bench.threads > bench.calls) {
+		bench.threads = bench.calls;
+	}
 
-	/* Display debugging info */
-	if (switch_event_get_header(event, "rednibble_debug")) {
-		debug_event_handler(event);
+	switch_core_new_memory_pool(&pool);
+	workers = switch_core_alloc(pool, sizeof(*workers) * bench.threads);
+	threads = switch_core_alloc(pool, sizeof(*threads) * bench.threads);
+	switch_threadattr_create(&thd_attr, pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Debiting %d simulated calls on %d threads for %" SWITCH_INT64_T_FMT "s\n", bench.calls,
+					  bench.threads, bench.duration / 1000000);
+
+	cpu = bench_cpu_time();
+	bench.start = switch_micro_time_now();
+
+	for (i = 0; i < bench.threads; i++) {
+		workers[i].bench = &bench;
+		workers[i].first = bench.calls * i / bench.threads;
+		workers[i].count = bench.calls * (i + 1) / bench.threads - workers[i].first;
+		switch_thread_create(&threads[i], thd_attr, bench_worker, &workers[i], pool);
 	}
 
-	/* Get session var */
-	if (!(session = switch_core_session_locate(uuid))) {
-		return;
+	for (i = 0; i < bench.threads; i++) {
+		switch_thread_join(&st, threads[i]);
+		hist_merge(&hist, &workers[i].hist);
+		heartbeats += workers[i].heartbeats;
+		commands += workers[i].commands;
+		failures += workers[i].failures;
 	}
 
-	/* Go bill */
-	do_billing(session);
+	elapsed = switch_micro_time_now() - bench.start;
+	cpu = bench_cpu_time() - cpu;
+	switch_core_destroy_memory_pool(&pool);
 
-	switch_core_session_rwunlock(session);
+	/* Don't leave the bench accounts behind */
+	if ((redis = credis_connect(globals.redis_host, globals.redis_port, globals.redis_timeout))) {
+		int rc = 0;
+
+		for (i = 0; i < bench.calls && rc >= -1; i++) {
+			switch_snprintf(key, sizeof(key), RN_BENCH_KEY_FMT, i);
+			rc = credis_del(redis, key);
+		}
+		credis_close(redis);
+	}
+
+	stream->write_function(stream, "calls: %d\n", bench.calls);
+	stream->write_function(stream, "threads: %d\n", bench.threads);
+	stream->write_function(stream, "seconds: %.3f\n", elapsed / 1000000.0);
+	stream->write_function(stream, "heartbeats: %" SWITCH_UINT64_T_FMT "\n", heartbeats);
+	stream->write_function(stream, "decrby: %" SWITCH_UINT64_T_FMT "\n", commands);
+	stream->write_function(stream, "decrby_per_second: %.1f\n", commands * 1000000.0 / elapsed);
+	stream->write_function(stream, "decrby_failures: %" SWITCH_UINT64_T_FMT "\n", failures);
+	stream->write_function(stream, "decrby_p50_us: %" SWITCH_INT64_T_FMT "\n", hist_percentile(&hist, 500));
+	stream->write_function(stream, "decrby_p99_us: %" SWITCH_INT64_T_FMT "\n", hist_percentile(&hist, 990));
+	stream->write_function(stream, "decrby_p999_us: %" SWITCH_INT64_T_FMT "\n", hist_percentile(&hist, 999));
+	stream->write_function(stream, "decrby_max_us: %" SWITCH_INT64_T_FMT "\n", hist.max);
+	/* The whole process, so whatever else the switch was doing counts too */
+	stream->write_function(stream, "cpu_us_per_decrby: %.1f\n", commands ? (double) cpu / commands : 0);
 }
 
 static void rednibblebill_pause(switch_core_session_t *session)
@@ -553,11 +3891,6 @@ static void rednibblebill_pause(switch_core_session_t *session)
 		return;
 	}
 
-	/* Lock this session's data for this module while we tinker with it */
-	if (globals.mutex) {
-		switch_mutex_lock(globals.mutex);
-	}
-
 	/* Get our rednibble data var. This will be NULL if it's our first call here for this session */
 	rednibble_data = (rednibble_data_t *) switch_channel_get_private(channel, "_rednibble_data_");
 
@@ -566,16 +3899,17 @@ static void rednibblebill_pause(switch_core_session_t *session)
 		return;
 	}
 
+	/* Lock this session's data for this module while we tinker with it */
+	switch_mutex_lock(rednibble_data->mutex);
+
 	/* Set pause counter if not already set */
 	if (rednibble_data->pausets == 0)
 		rednibble_data->pausets = ts;
 
-	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Paused billing timestamp!\n");
-
 	/* Done checking - release lock */
-	if (globals.mutex) {
-		switch_mutex_unlock(globals.mutex);
-	}
+	switch_mutex_unlock(rednibble_data->mutex);
+
+	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Paused billing timestamp!\n");
 }
 
 static void rednibblebill_resume(switch_core_session_t *session)
@@ -583,7 +3917,8 @@ static void rednibblebill_resume(switch_core_session_t *session)
 	switch_channel_t *channel = switch_core_session_get_channel(session);
 	switch_time_t ts = switch_micro_time_now();
 	rednibble_data_t *rednibble_data;
-	const char *billrate;
+	const rednibble_profile_t *billing;
+	rednibble_money_t adjustment;
 
 	if (!channel) {
 		return;
@@ -598,30 +3933,30 @@ static void rednibblebill_resume(switch_core_session_t *session)
 		return;
 	}
 
-	if (rednibble_data->pausets == 0) {
-		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG,
-						  "Can't resume - channel is not paused! (This is expected at hangup time)\n");
+	if (!(billing = profile_get(session))) {
 		return;
 	}
 
 	/* Lock this session's data for this module while we tinker with it */
-	if (globals.mutex) {
-		switch_mutex_lock(globals.mutex);
-	}
+	switch_mutex_lock(rednibble_data->mutex);
 
-	billrate = switch_channel_get_variable(channel, "rednibble_rate");
+	if (rednibble_data->pausets == 0) {
+		switch_mutex_unlock(rednibble_data->mutex);
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG,
+						  "Can't resume - channel is not paused! (This is expected at hangup time)\n");
+		return;
+	}
 
 	/* Calculate how much was "lost" to billings during pause - we do this here because you never know when the billrate may change during a call */
-	rednibble_data->bill_adjustments += (atof(billrate) / 1000000 / 60) * ((ts - rednibble_data->pausets));
-	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Resumed billing! Subtracted %f from this billing cycle.\n",
-					  (atof(billrate) / 1000000 / 60) * ((ts - rednibble_data->pausets)));
-
+	adjustment = money_for_time_down(billing->rate, ts - rednibble_data->pausets);
+	rednibble_data->bill_adjustments += adjustment;
 	rednibble_data->pausets = 0;
 
 	/* Done checking - release lock */
-	if (globals.mutex) {
-		switch_mutex_unlock(globals.mutex);
-	}
+	switch_mutex_unlock(rednibble_data->mutex);
+
+	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Resumed billing! Subtracted " RN_MONEY_FMT " from this billing cycle.\n",
+					  RN_MONEY_ARGS(adjustment));
 }
 
 static void rednibblebill_reset(switch_core_session_t *session)
@@ -643,29 +3978,25 @@ static void rednibblebill_reset(switch_core_session_t *session)
 	}
 
 	/* Lock this session's data for this module while we tinker with it */
-	if (globals.mutex) {
-		switch_mutex_lock(globals.mutex);
-	}
+	switch_mutex_lock(rednibble_data->mutex);
 
 	/* Update the last time we billed */
 	rednibble_data->lastts = ts;
 
-	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Reset last billing timestamp marker to right now!\n");
-
 	/* Done checking - release lock */
-	if (globals.mutex) {
-		switch_mutex_unlock(globals.mutex);
-	}
+	switch_mutex_unlock(rednibble_data->mutex);
+
+	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Reset last billing timestamp marker to right now!\n");
 }
 
-static double rednibblebill_check(switch_core_session_t *session)
+static rednibble_money_t rednibblebill_check(switch_core_session_t *session)
 {
 	switch_channel_t *channel = switch_core_session_get_channel(session);
 	rednibble_data_t *rednibble_data;
-	double amount = 0;
+	rednibble_money_t amount = 0;
 
 	if (!channel) {
-		return -99999;
+		return -99999 * RN_MONEY_SCALE;
 	}
 
 	/* Get our rednibble data var. This will be NULL if it's our first call here for this session */
@@ -673,47 +4004,42 @@ static double rednibblebill_check(switch_core_session_t *session)
 
 	if (!rednibble_data) {
 		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Can't check - channel is not initialized for billing!\n");
-		return -99999;
+		return -99999 * RN_MONEY_SCALE;
 	}
 
 	/* Lock this session's data for this module while we tinker with it */
-	if (globals.mutex) {
-		switch_mutex_lock(globals.mutex);
-	}
+	switch_mutex_lock(rednibble_data->mutex);
 
 	amount = rednibble_data->total;
 
 	/* Done checking - release lock */
-	if (globals.mutex) {
-		switch_mutex_unlock(globals.mutex);
-	}
+	switch_mutex_unlock(rednibble_data->mutex);
 
 	return amount;
 }
 
-static void rednibblebill_adjust(switch_core_session_t *session, double amount)
+static void rednibblebill_adjust(switch_core_session_t *session, rednibble_money_t amount)
 {
 	switch_channel_t *channel = switch_core_session_get_channel(session);
-	const char *billaccount;
+	const rednibble_profile_t *billing;
 
 	if (!channel) {
 		return;
 	}
 
-	/* Variables kept in FS but relevant only to this module */
-
-	billaccount = switch_channel_get_variable(channel, "rednibble_account");
-
 	/* Return if there's no billing information on this session */
-	if (!billaccount) {
+	if (!(billing = profile_get(session))) {
 		return;
 	}
 
 	/* Add or remove amount from adjusted billing here. Note, we bill the OPPOSITE */
-	if (bill_event(-amount, billaccount, channel) == SWITCH_STATUS_SUCCESS) {
-		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Recorded adjustment to %s for %f\n", billaccount, amount);
+	if (bill_event(-amount, billing->key, channel, NULL) == SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Recorded adjustment to %s for " RN_MONEY_FMT "\n", billing->account,
+						  RN_MONEY_ARGS(amount));
+		ledger_add("adjust", switch_core_session_get_uuid(session), billing->account, -amount, billing->rate, 0);
 	} else {
-		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Failed to record adjustment to %s for %f\n", billaccount, amount);
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Failed to record adjustment to %s for " RN_MONEY_FMT "\n", billing->account,
+						  RN_MONEY_ARGS(amount));
 	}
 }
 
@@ -727,51 +4053,59 @@ SWITCH_STANDARD_APP(rednibblebill_app_function)
 	if (!zstr(data) && (lbuf = strdup(data))
 		&& (argc = switch_separate_string(lbuf, ' ', argv, (sizeof(argv) / sizeof(argv[0]))))) {
 		if (!strcasecmp(argv[0], "adjust") && argc == 2) {
-			rednibblebill_adjust(session, atof(argv[1]));
+			rednibblebill_adjust(session, money_parse(argv[1]));
 		} else if (!strcasecmp(argv[0], "flush")) {
-			do_billing(session);
+			do_billing(session, NULL);
 		} else if (!strcasecmp(argv[0], "pause")) {
 			rednibblebill_pause(session);
 		} else if (!strcasecmp(argv[0], "resume")) {
 			rednibblebill_resume(session);
 		} else if (!strcasecmp(argv[0], "check")) {
-			switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Current billing is at %f\n", rednibblebill_check(session));
+			rednibble_money_t total = rednibblebill_check(session);
+			switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Current billing is at " RN_MONEY_FMT "\n", RN_MONEY_ARGS(total));
 		} else if (!strcasecmp(argv[0], "reset")) {
 			rednibblebill_reset(session);
 		} else if (!strcasecmp(argv[0], "heartbeat") && argc == 2) {
-			switch_core_session_enable_heartbeat(session, atoi(argv[1]));
+			billing_timer_schedule(session, atoi(argv[1]));
 		}
 	}
 	switch_safe_free(lbuf);
 }
 
 /* We get here from the API only (theoretically) */
-#define API_SYNTAX "<uuid> [pause | resume | reset | adjust <amount> | heartbeat <seconds> | check]"
+#define API_SYNTAX "status | " STATS_SYNTAX " | " BENCH_SYNTAX " | <uuid> [pause | resume | reset | adjust <amount> | heartbeat <seconds> | check]"
 SWITCH_STANDARD_API(rednibblebill_api_function)
 {
 	switch_core_session_t *psession = NULL;
-	char *mycmd = NULL, *argv[3] = { 0 };
+	char *mycmd = NULL, *argv[8] = { 0 };
 	int argc = 0;
 
 	if (!zstr(cmd) && (mycmd = strdup(cmd))) {
 		argc = switch_separate_string(mycmd, ' ', argv, (sizeof(argv) / sizeof(argv[0])));
-		if ((argc == 2 || argc == 3) && !zstr(argv[0])) {
+		if (argc == 1 && !strcasecmp(argv[0], "status")) {
+			billing_workers_status(stream);
+		} else if (argc >= 1 && !strcasecmp(argv[0], "stats")) {
+			stats_show(argc, argv, stream);
+		} else if (argc >= 1 && !strcasecmp(argv[0], "bench")) {
+			bench_run(argc, argv, stream);
+		} else if ((argc == 2 || argc == 3) && !zstr(argv[0])) {
 			char *uuid = argv[0];
 			if ((psession = switch_core_session_locate(uuid))) {
 				if (!strcasecmp(argv[1], "adjust") && argc == 3) {
-					rednibblebill_adjust(psession, atof(argv[2]));
+					rednibblebill_adjust(psession, money_parse(argv[2]));
 				} else if (!strcasecmp(argv[1], "flush")) {
-					do_billing(psession);
+					do_billing(psession, NULL);
 				} else if (!strcasecmp(argv[1], "pause")) {
 					rednibblebill_pause(psession);
 				} else if (!strcasecmp(argv[1], "resume")) {
 					rednibblebill_resume(psession);
 				} else if (!strcasecmp(argv[1], "check")) {
-					switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Current billing is at %f\n", rednibblebill_check(psession));
+					rednibble_money_t total = rednibblebill_check(psession);
+					switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "Current billing is at " RN_MONEY_FMT "\n", RN_MONEY_ARGS(total));
 				} else if (!strcasecmp(argv[1], "reset")) {
 					rednibblebill_reset(psession);
 				} else if (!strcasecmp(argv[1], "heartbeat") && argc == 3) {
-					switch_core_session_enable_heartbeat(psession, atoi(argv[2]));
+					billing_timer_schedule(psession, atoi(argv[2]));
 				}
 
 				switch_core_session_rwunlock(psession);
@@ -792,26 +4126,13 @@ SWITCH_STANDARD_API(rednibblebill_api_function)
 
 static switch_status_t sched_billing(switch_core_session_t *session)
 {
-	switch_channel_t *channel = NULL;
-	
-	const char *billrate = NULL;
-	const char *billaccount = NULL;
-	
-	if (!(channel = switch_core_session_get_channel(session))) {
-		return SWITCH_STATUS_SUCCESS;
-	}
-
-	/* Variables kept in FS but relevant only to this module */
-	billrate = switch_channel_get_variable(channel, "rednibble_rate");
-	billaccount = switch_channel_get_variable(channel, "rednibble_account");
-	
 	/* Return if there's no billing information on this session */
-	if (!billrate || !billaccount) {
+	if (!profile_get(session)) {
 		return SWITCH_STATUS_SUCCESS;
 	}
 
 	if (globals.global_heartbeat > 0) {
-		switch_core_session_enable_heartbeat(session, globals.global_heartbeat);
+		billing_timer_schedule(session, globals.global_heartbeat);
 	}
 
 	/* TODO: Check account balance here */
@@ -819,10 +4140,48 @@ static switch_status_t sched_billing(switch_core_session_t *session)
 	return SWITCH_STATUS_SUCCESS;
 }
 
+/* Give credit reserved for the call and not spent back to the account. On success the account balance
+   is returned in balance (if not NULL) */
+static switch_status_t reservation_return(switch_core_session_t *session, rednibble_money_t *balance)
+{
+	switch_channel_t *channel = switch_core_session_get_channel(session);
+	rednibble_data_t *rednibble_data;
+	const rednibble_profile_t *billing;
+	rednibble_money_t unused, after;
+
+	if (!(rednibble_data = (rednibble_data_t *) switch_channel_get_private(channel, "_rednibble_data_")) || !(billing = profile_get(session))) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	switch_mutex_lock(rednibble_data->mutex);
+	unused = rednibble_data->reserved;
+	rednibble_data->reserved = 0;
+	switch_mutex_unlock(rednibble_data->mutex);
+
+	if (unused <= 0) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (bill_event(-unused, billing->key, channel, &after) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_CRIT, "Failed to return " RN_MONEY_FMT " of reserved credit to %s!\n",
+						  RN_MONEY_ARGS(unused), billing->account);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (balance && after != RN_BALANCE_UNKNOWN) {
+		*balance = after;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Returned " RN_MONEY_FMT " of reserved credit to %s\n", RN_MONEY_ARGS(unused),
+					  billing->account);
+	return SWITCH_STATUS_SUCCESS;
+}
+
 static switch_status_t process_hangup(switch_core_session_t *session)
 {
-	const char* billaccount;
+	const rednibble_profile_t *billing;
 	switch_channel_t *channel = NULL;
+	rednibble_money_t balance;
 
 	channel = switch_core_session_get_channel(session);
 	
@@ -830,17 +4189,75 @@ static switch_status_t process_hangup(switch_core_session_t *session)
 	/*  rednibblebill_resume(session); */
 
 	/* Now go handle like normal billing */
-	do_billing(session);
+	if (do_billing(session, &balance) != SWITCH_STATUS_SUCCESS) {
+		if (!(billing = profile_get(session))) {
+			return SWITCH_STATUS_SUCCESS;
+		}
+		/* Nothing was billed this time round, so we have to ask */
+		balance = get_balance(billing->key, channel);
+	}
 
-	billaccount = switch_channel_get_variable(channel, "rednibble_account");
-	if (billaccount) {
-		switch_channel_set_variable_printf(channel, "rednibble_current_balance", "%f", get_balance(billaccount, channel));
-	}			
+	/* Whatever the call didn't use of its reserved credit goes back, the next heartbeat reserves again if it goes on */
+	reservation_return(session, &balance);
+
+	if (balance != RN_BALANCE_UNKNOWN) {
+		switch_channel_set_variable_printf(channel, "rednibble_current_balance", RN_MONEY_FMT, RN_MONEY_ARGS(balance));
+	}
 	
 	return SWITCH_STATUS_SUCCESS;
 }
 
+/* Remember a channel that made it to media or hangup without billing variables as not billed, every later
+   state change then only costs a private lookup. Returns SWITCH_FALSE for such channels */
+static switch_bool_t billing_settle(switch_core_session_t *session)
+{
+	switch_channel_t *channel = switch_core_session_get_channel(session);
+
+	if (!profile_get(session)) {
+		/* A call that was billed before still has timers and credit to clean up */
+		if (globals.remember_unbilled && !switch_channel_get_private(channel, "_rednibble_profile_") &&
+			!switch_channel_get_private(channel, "_rednibble_unbilled_")) {
+			switch_channel_set_private(channel, "_rednibble_unbilled_", &rednibble_unbilled);
+			switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG,
+							  "No rednibble_account and rednibble_rate by %s, not billing this call\n", switch_channel_state_name(switch_channel_get_state(channel)));
+		}
+		return SWITCH_FALSE;
+	}
+
+	return SWITCH_TRUE;
+}
+
+static switch_status_t process_final_hangup(switch_core_session_t *session)
+{
+	if (!billing_settle(session) && switch_channel_get_private(switch_core_session_get_channel(session), "_rednibble_unbilled_")) {
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	/* No more heartbeats, this is the last time the call is billed */
+	billing_timer_cancel(session);
+	process_hangup(session);
+	account_untrack(session);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_status_t process_destroy(switch_core_session_t *session)
+{
+	if (switch_channel_get_private(switch_core_session_get_channel(session), "_rednibble_unbilled_")) {
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	billing_timer_cancel(session);
+	/* A reservation may have come back from redis after hangup */
+	reservation_return(session, NULL);
+	account_untrack(session);
+	return SWITCH_STATUS_SUCCESS;
+}
+
 static switch_status_t process_and_sched(switch_core_session_t *session) {
+	if (!billing_settle(session)) {
+		return SWITCH_STATUS_SUCCESS;
+	}
+
 	process_hangup(session);
 	sched_billing(session);
 	return SWITCH_STATUS_SUCCESS;
@@ -850,7 +4267,7 @@ switch_state_handler_table_t rednibble_state_handler = {
 	/* on_init */ NULL,
 	/* on_routing */ process_hangup, 	/* Need to add a check here for anything in their account before routing */
 	/* on_execute */ sched_billing, 	/* Turn on heartbeat for this session and do an initial account check */
-	/* on_hangup */ process_hangup, 	/* On hangup - most important place to go bill */
+	/* on_hangup */ process_final_hangup, 	/* On hangup - most important place to go bill */
 	/* on_exch_media */ process_and_sched,
 	/* on_soft_exec */ NULL,
 	/* on_consume_med */ process_and_sched,
@@ -858,22 +4275,45 @@ switch_state_handler_table_t rednibble_state_handler = {
 	/* on_reset */ NULL,
 	/* on_park */ NULL,
 	/* on_reporting */ NULL, 
-	/* on_destroy */ NULL
+	/* on_destroy */ process_destroy
 };
 
 SWITCH_MODULE_LOAD_FUNCTION(mod_rednibblebill_load)
 {
 	switch_api_interface_t *api_interface;
 	switch_application_interface_t *app_interface;
-	REDIS redis;
 
 	/* Set every byte in this structure to 0 */
 	memset(&globals, 0, sizeof(globals));
+	globals.balance_deadlines = SWITCH_TRUE;
+	globals.breaker_failure_pct = 50;
+	globals.breaker_min_calls = 20;
+	globals.breaker_window_ms = 10000;
+	globals.breaker_open_ms = 5000;
 	globals.pool = pool;
 	switch_mutex_init(&globals.mutex, SWITCH_MUTEX_NESTED, globals.pool);
+	switch_mutex_init(&globals.stats_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+	switch_mutex_init(&globals.accounts_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+	switch_core_hash_init(&globals.accounts, globals.pool);
+	switch_mutex_init(&globals.breaker_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+	switch_mutex_init(&globals.balances_mutex, SWITCH_MUTEX_NESTED, globals.pool);
+	switch_core_hash_init(&globals.balances, globals.pool);
+	globals.stats = switch_core_alloc(globals.pool, sizeof(rednibble_stats_t) * RN_STATS_SHARDS);
+	globals.stats_since = switch_micro_time_now();
 
 	load_config();
 
+#ifdef CREDIS_FAULTS
+	credis_set_faults(&globals.redis_faults);
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Built with redis fault injection, not for production use!\n");
+#endif
+
+	/* Prewarm the redis connection pool */
+	if (!redis_pool_init()) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't open any redis connection!\n");
+		return SWITCH_STATUS_FALSE;
+	}
+
 	/* connect my internal structure to the blank pointer passed to me */
 	*module_interface = switch_loadable_module_create_module_interface(pool, modname);
 
@@ -885,6 +4325,34 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_rednibblebill_load)
 				   "Pause, resume, reset, adjust, flush, heartbeat commands to handle billing.", rednibblebill_app_function, APP_SYNTAX,
 				   SAF_SUPPORT_NOMEDIA | SAF_ROUTING_EXEC);
 
+	if (globals.billing_mode == RN_BILLING_SCRIPT && load_billing_script() != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Falling back to classic billing mode\n");
+		globals.billing_mode = RN_BILLING_CLASSIC;
+	}
+
+	if (globals.reserve_us > 0 && globals.billing_mode == RN_BILLING_SCRIPT) {
+		/* The script would count the reserved credit towards the call's total */
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "reserve_minutes is ignored in script billing mode\n");
+		globals.reserve_us = 0;
+	}
+
+	journal_open();
+	ledger_start();
+	billing_workers_start();
+	batch_start();
+	wheel_start();
+
+	if (globals.redis_async_enabled) {
+#ifdef CREDIS_ASYNC
+		if (!(globals.redis_async = credis_async_connect(globals.redis_host, globals.redis_port, globals.redis_timeout,
+														 globals.redis_async_connections))) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Couldn't start asynchronous redis client, billing heartbeats through the pool\n");
+		}
+#else
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Asynchronous redis client not available on this platform, billing heartbeats through the pool\n");
+#endif
+	}
+
 	/* register state handlers for billing */
 	switch_core_add_state_handler(&rednibble_state_handler);
 
@@ -895,10 +4363,6 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_rednibblebill_load)
 		return SWITCH_STATUS_GENERR;
 	}
 
-	if (redis_factory(&redis) != SWITCH_STATUS_SUCCESS) {
-		return SWITCH_STATUS_FALSE;
-	}
-
 	/* indicate that the module should continue to be loaded */
 	return SWITCH_STATUS_SUCCESS;
 }
@@ -907,12 +4371,31 @@ SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_rednibblebill_shutdown)
 {
 	switch_event_unbind(&globals.node);
 	switch_core_remove_state_handler(&rednibble_state_handler);
-	
+	wheel_stop();
+
+#ifdef CREDIS_ASYNC
+	/* Replies still outstanding are failed and handed to the workers, so stop this first */
+	if (globals.redis_async) {
+		credis_async_close(globals.redis_async);
+		globals.redis_async = NULL;
+	}
+#endif
+	batch_stop();
+	billing_workers_stop();
+	ledger_stop();
+	journal_close();
+	redis_pool_destroy();
+	balances_destroy();
+#ifdef CREDIS_FAULTS
+	credis_set_faults(NULL);
+#endif
 
 	switch_safe_free(globals.redis_host);
 	switch_safe_free(globals.percall_action);
 	switch_safe_free(globals.lowbal_action);
 	switch_safe_free(globals.nobal_action);
+	switch_safe_free(globals.ledger_stream);
+	switch_safe_free(globals.journal_file);
 
 	return SWITCH_STATUS_UNLOAD;
 }